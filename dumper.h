@@ -1,6 +1,8 @@
 				/* 5 bytes per 36-bit word */
 				/* 518 word logical blocks */
-#define TAPEBLK  518*5*15
+				/* 15 per record as written, up to 64
+				   per record if reblocked */
+#define TAPEBLK  518*5*64
 
 				/* Checksum is first word */
 #define WdoffChecksum      0
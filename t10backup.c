@@ -42,6 +42,9 @@
 
 #define RAWSIZE (5*(32+512))
 
+/* tape records may hold several blocks if reblocked by tapecopy */
+#define MAXBLOCKS 64
+
 #define endof(s) (strchr(s, (char) 0))
 
 char *progname;
@@ -406,17 +409,31 @@ void printfileinfo (void)
 /* readblock reads one logical block from the input stream. */
 /* The header is unpacked into head{l,r}; the data is not. */
 
+unsigned char tapebuf [MAXBLOCKS * RAWSIZE];	/* Current tape record. */
+long tapebuflen = 0;		/* Length of it. */
+long tapebufpos = 0;		/* Offset of next block in it. */
+
 int readblock (void)
 {
   long i;
-  i = getrec (tape, rawdata, RAWSIZE);
-  if (i == 0)
-    return (0);
-  if (i != RAWSIZE)
+  if (tapebufpos >= tapebuflen)
     {
-      fprintf (stderr, "record length %ld, expected %d\n", i, RAWSIZE);
-      while (i++ < RAWSIZE) rawdata [i] = (char) 0;
+      tapebufpos = 0;
+      tapebuflen = 0;
+      i = getrec (tape, tapebuf, sizeof (tapebuf));
+      if (i == 0)
+	return (0);
+      if ((i % RAWSIZE) != 0)
+	{
+	  fprintf (stderr, "record length %ld, expected %d\n", i, RAWSIZE);
+	  if (i > RAWSIZE)
+	    i = RAWSIZE;
+	  while (i < RAWSIZE) tapebuf [i++] = (char) 0;
+	}
+      tapebuflen = i;
     }
+  memcpy (rawdata, tapebuf + tapebufpos, RAWSIZE);
+  tapebufpos += RAWSIZE;
   unpackheader ();
   return (1);
 }
@@ -591,6 +608,7 @@ int doextract (void)
 		    printf ("\n");
 		  if (argcount == 0)
 		    {
+		      tapebufpos = tapebuflen;  /* rest of record is in file */
 		      skipfile (tape, 1);
 		      return (1);
 		    }
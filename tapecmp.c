@@ -0,0 +1,398 @@
+/*
+   tapecmp
+
+   Compare two tapes record by record: tape mark structure, record
+   lengths, and data.  Exits 0 if they're the same, 1 if they differ,
+   and 2 on trouble, as with cmp.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as published
+   by the Free Software Foundation.  Note that permission is not granted
+   to redistribute this program under the terms of any other version of the
+   General Public License.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdio.h"
+#include "stdarg.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+#include "sys/stat.h"
+
+#include "tapeio.h"
+
+#define MAX_REC_LEN TAPE_MAX_REC_LEN
+
+/* default number of differences reported */
+#define MAX_DIFFS 10
+
+
+typedef unsigned long long u64;
+
+
+char *progname;
+
+void print_usage (FILE *f)
+{
+  fprintf (f, "Usage: %s [-v] [-n count] [-i a-index -i b-index] a b\n",
+	   progname);
+}
+
+/* every error exits 2, only a usage error prints the usage */
+void fatal (int usage, char *fmt, ...)
+{
+  va_list ap;
+
+  if (fmt)
+    {
+      fprintf (stderr, "%s: ", progname);
+      va_start (ap, fmt);
+      vfprintf (stderr, fmt, ap);
+      va_end (ap);
+    }
+
+  if (usage)
+    print_usage (stderr);
+
+  exit (2);
+}
+
+
+int maxdiffs = MAX_DIFFS;
+int diffs = 0;
+
+/* position reached */
+int file = 0;
+u64 record = 0;
+u64 records = 0;
+u64 bytes = 0;
+
+void difference (char *fmt, ...)
+{
+  va_list ap;
+
+  if (diffs++ >= maxdiffs)
+    return;
+  va_start (ap, fmt);
+  vprintf (fmt, ap);
+  va_end (ap);
+}
+
+
+/* offset of the first differing byte of two buffers, or -1 if they're
+   the same; memcmp() is the vectorized path for the common case of
+   equal records, and the difference is only located if there is one */
+int first_diff (unsigned char *a, unsigned char *b, int len)
+{
+  int i = 0;
+  u64 wa, wb;
+
+  if (memcmp (a, b, len) == 0)
+    return (-1);
+  for (; i + sizeof (u64) <= len; i += sizeof (u64))
+    {
+      memcpy (& wa, a + i, sizeof (u64));
+      memcpy (& wb, b + i, sizeof (u64));
+      if (wa != wb)
+	break;
+    }
+  for (; i < len; i++)
+    if (a [i] != b [i])
+      return (i);
+  return (-1);
+}
+
+
+/* -i: the record lengths of each tape, as written by tapewrite -i, one
+   per line with 0 for a tape mark; while two image files have the same
+   lengths their framing is the same, so that stretch can be compared a
+   buffer at a time, and a difference only has to be traced back to its
+   record */
+char *idxfn [2];
+
+
+/* read an index, and check that it accounts for every byte of its image */
+int *read_index (char *fn, int fd, u64 *count)
+{
+  FILE *f;
+  int *lens = NULL;
+  u64 n = 0, size = 0;
+  off_t total = 0;
+  unsigned int len;
+  struct stat st;
+
+  f = fopen (fn, "r");
+  if (! f)
+    fatal (0, "can't open %s\n", fn);
+  while (fscanf (f, "%u", & len) == 1)
+    {
+      if (n == size)
+	{
+	  size = size ? 2 * size : 1024;
+	  lens = realloc (lens, size * sizeof (int));
+	  if (! lens)
+	    fatal (0, "can't allocate index\n");
+	}
+      if (len > MAX_REC_LEN)
+	fatal (0, "%s: record length %u too long\n", fn, len);
+      lens [n++] = len;
+      total += len ? (off_t) len + 8 : 4;
+    }
+  fclose (f);
+  if (fstat (fd, & st) < 0 || st.st_size != total)
+    fatal (0, "%s doesn't match its image\n", fn);
+  *count = n;
+  return (lens);
+}
+
+
+/* bytes of image taken by a record of length "len" */
+off_t image_len (int len)
+{
+  return (len ? (off_t) len + 8 : 4);
+}
+
+
+/* count a record or tape mark of the same length on both tapes */
+void count_record (int len)
+{
+  if (len == 0)
+    {
+      file++;
+      record = 0;
+    }
+  else
+    {
+      records++;
+      record++;
+      bytes += len;
+    }
+}
+
+
+void read_at (int fd, char *fn, unsigned char *buf, int len, off_t pos)
+{
+  ssize_t n;
+
+  for (; len > 0; buf += n, len -= n, pos += n)
+    if ((n = pread (fd, buf, len, pos)) <= 0)
+      fatal (0, "can't read %s\n", fn);
+}
+
+
+/* compare the first "n" records of two images, whose indexes both give
+   them the lengths in "lens", and leave both images just past them */
+void compare_indexed (int fda, char *fna, int fdb, char *fnb, int *lens,
+		      u64 n, unsigned char *bufa, unsigned char *bufb)
+{
+  off_t pos = 0, end = 0, recstart = 0;
+  u64 i;
+  int chunk, d;
+
+  for (i = 0; i < n; i++)
+    end += image_len (lens [i]);
+
+  i = 0;
+  while (pos < end)
+    {
+      chunk = (end - pos > MAX_REC_LEN) ? MAX_REC_LEN : end - pos;
+      read_at (fda, fna, bufa, chunk, pos);
+      read_at (fdb, fnb, bufb, chunk, pos);
+      if ((d = first_diff (bufa, bufb, chunk)) < 0)
+	{
+	  pos += chunk;
+	  continue;
+	}
+
+      /* find the record it's in, and go on from the next one */
+      pos += d;
+      for (; recstart + image_len (lens [i]) <= pos; i++)
+	{
+	  count_record (lens [i]);
+	  recstart += image_len (lens [i]);
+	}
+      if (lens [i] == 0 || pos < recstart + 4 ||
+	  pos >= recstart + 4 + lens [i])
+	fatal (0, "%s and %s don't match their indexes\n", fna, fnb);
+      difference ("file %d record %llu: differs at byte %d\n", file, record,
+		  (int) (pos - recstart - 4));
+      count_record (lens [i]);
+      pos = recstart += image_len (lens [i++]);
+    }
+  for (; i < n; i++)
+    count_record (lens [i]);
+
+  if (lseek (fda, end, SEEK_SET) != end || lseek (fdb, end, SEEK_SET) != end)
+    fatal (0, "can't seek image\n");
+}
+
+
+/* read records until just past the next tape mark, return count */
+int skip_to_mark (tape_handle_t t, unsigned char *buf)
+{
+  int n = 0;
+
+  while (getrec (t, buf, MAX_REC_LEN) != 0)
+    n++;
+  return (n);
+}
+
+
+int main (int argc, char *argv[])
+{
+  int lena, lenb;
+  int preva = -1, prevb = -1;
+  int i, n;
+  int verbose = 0;
+  char *fna = NULL;
+  char *fnb = NULL;
+  tape_handle_t a, b;
+  unsigned char *bufa, *bufb;
+  int fda, fdb;
+  int *lensa, *lensb;
+  u64 na, nb, same;
+
+  progname = argv [0];
+  tapefailstatus (2);
+
+  while (++argv, --argc)
+    {
+      if ((argv [0][0] == '-') && (argv [0][1] != '\0'))
+	{
+	  if (argv [0][1] == 'v')
+	    verbose++;
+	  else if (argv [0][1] == 'n')
+	    {
+	      if (! --argc)
+		fatal (1, "count missing\n");
+	      maxdiffs = atoi ((++argv) [0]);
+	    }
+	  else if (argv [0][1] == 'i')
+	    {
+	      if (! --argc)
+		fatal (1, "index file name missing\n");
+	      if (idxfn [1])
+		fatal (1, "only one index per tape\n");
+	      idxfn [idxfn [0] != NULL] = (++argv) [0];
+	    }
+	  else
+	    fatal (1, "unrecognized option '%s'\n", argv [0]);
+	}
+      else if (! fna)
+	fna = argv [0];
+      else if (! fnb)
+	fnb = argv [0];
+      else
+	fatal (1, NULL);
+    }
+
+  if (! fnb || (idxfn [0] && ! idxfn [1]))
+    fatal (1, NULL);
+
+  bufa = malloc (MAX_REC_LEN);
+  bufb = malloc (MAX_REC_LEN);
+  if (! bufa || ! bufb)
+    fatal (0, "can't allocate buffers\n");
+
+  a = opentape (fna, 0, 0);
+  if (! a)
+    fatal (0, "can't open %s\n", fna);
+  b = opentape (fnb, 0, 0);
+  if (! b)
+    fatal (0, "can't open %s\n", fnb);
+
+  /* compare the stretch at the start where the indexes agree in bulk,
+     stopping short of the end of tape */
+  if (idxfn [0])
+    {
+      if ((fda = tapeimagefd (a)) < 0 || (fdb = tapeimagefd (b)) < 0)
+	fatal (0, "indexes can only be used with image files\n");
+      lensa = read_index (idxfn [0], fda, & na);
+      lensb = read_index (idxfn [1], fdb, & nb);
+      for (same = 0; same < na && same < nb && lensa [same] == lensb [same];
+	   same++)
+	if (lensa [same] == 0 && same && lensa [same - 1] == 0)
+	  break;
+      compare_indexed (fda, fna, fdb, fnb, lensa, same, bufa, bufb);
+      if (same)
+	preva = prevb = lensa [same - 1];
+      free (lensa);
+      free (lensb);
+    }
+
+  for (;;)
+    {
+      lena = getrec (a, bufa, MAX_REC_LEN);
+      lenb = getrec (b, bufb, MAX_REC_LEN);
+
+      /* a second tape mark in a row is the end of tape */
+      if ((lena == 0 && preva == 0) || (lenb == 0 && prevb == 0))
+	{
+	  if (lena != 0 || lenb != 0 || preva != 0 || prevb != 0)
+	    difference ("file %d: %s has more data\n", file,
+			(lena == 0 && preva == 0) ? fnb : fna);
+	  break;
+	}
+
+      if ((lena == 0) != (lenb == 0))
+	{
+	  /* one has a tape mark where the other has data, line them up
+	     again at the end of this file */
+	  if (lena == 0)
+	    {
+	      n = 1 + skip_to_mark (b, bufb);
+	      difference ("file %d record %llu: %s has %d more records\n",
+			  file, record, fnb, n);
+	    }
+	  else
+	    {
+	      n = 1 + skip_to_mark (a, bufa);
+	      difference ("file %d record %llu: %s has %d more records\n",
+			  file, record, fna, n);
+	    }
+	  lena = lenb = 0;
+	}
+      else if (lena != lenb)
+	difference ("file %d record %llu: length %d vs %d\n",
+		    file, record, lena, lenb);
+      else if (lena != 0)
+	{
+	  if ((i = first_diff (bufa, bufb, lena)) >= 0)
+	    difference ("file %d record %llu: differs at byte %d\n",
+			file, record, i);
+	  bytes += lena;
+	}
+
+      if (lena == 0)
+	{
+	  file++;
+	  record = 0;
+	}
+      else
+	{
+	  records++;
+	  record++;
+	}
+      preva = lena;
+      prevb = lenb;
+    }
+
+  if (diffs > maxdiffs)
+    printf ("%d more differences\n", diffs - maxdiffs);
+  if (verbose)
+    printf ("%d files, %llu records, %llu bytes compared\n", file, records,
+	    bytes);
+
+  closetape (a);
+  closetape (b);
+
+  return (diffs ? 1 : 0);
+}
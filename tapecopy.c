@@ -27,11 +27,35 @@
 
 #include "stdio.h"
 #include "stdlib.h"
+#include "limits.h"
 #include "stdarg.h"
+#include "errno.h"
+#include "pthread.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "sys/stat.h"
+#include "sys/types.h"
+#include "sys/wait.h"
 
 #include "tapeio.h"
 
-#define MAX_REC_LEN 32768
+#define MAX_REC_LEN TAPE_MAX_REC_LEN
+
+/* records buffered between the reader and the writers; every buffer can
+   hold the largest record, but only the part actually used is touched */
+#define QUEUE_ENTRIES 128
+
+/* records copied between checkpoints in the journal */
+#define JOURNAL_INTERVAL 256
+
+/* validated image to let accumulate before copying it, in bytes or
+   records, whichever comes first; it's also copied at each tape mark */
+#define FAST_COPY_CHUNK (64 * 1024 * 1024)
+#define FAST_COPY_RECORDS 256
+
+typedef unsigned long long u64;
 
 char *progname;
 
@@ -39,7 +63,13 @@ char *buf;
 
 void print_usage (FILE *f)
 {
-  fprintf (f, "Usage: %s [-v] in out\n", progname);
+  fprintf (f, "Usage: %s [-v] in [out...]\n", progname);
+  fprintf (f, "       %s [-v] --journal|--resume in out\n", progname);
+  fprintf (f, "       %s [-v] -b count|-u size in out...\n", progname);
+  fprintf (f, "       %s [-v] --stats file|- in [out...]\n", progname);
+  fprintf (f, "       %s [-v] --delta in out\n", progname);
+  fprintf (f, "       %s -m [-v] in out [in out...]\n", progname);
+  fprintf (f, "       %s [-v] [-j jobs] --batch manifest\n", progname);
 }
 
 void fatal (int retval, char *fmt, ...)
@@ -60,75 +90,1259 @@ void fatal (int retval, char *fmt, ...)
   exit (retval);
 }
 
+/* state of one source/destination pair in multiplexed mode */
+struct pair
+{
+  char *srcfn;
+  tape_handle_t dest;
+  int file;
+  int prevlen;
+  u64 tapebytes;
+};
+
+int verbose = 0;
+
+
+/* tapeloop() callback for multiplexed mode: copy one record */
+int copy_pair_rec (int index, void *buf, int len, void *arg)
+{
+  struct pair *p = (struct pair *) arg + index;
+
+  if (len != 0)
+    {
+      putrec (p->dest, buf, len);
+      p->tapebytes += len;
+    }
+  else
+    {
+      tapemark (p->dest);
+      if (p->prevlen == 0)
+	{
+	  if (verbose)
+	    {
+	      printf ("%s: end of tape, %d files, %llu total bytes\n",
+		      p->srcfn, p->file, p->tapebytes);
+	      fflush (stdout);
+	    }
+	  return (1);
+	}
+      p->file++;
+    }
+  p->prevlen = len;
+  return (0);
+}
+
+
+/* copy several tapes at once, one destination per source */
+int copy_multiplexed (int count, char **fns)
+{
+  tape_handle_t *src;
+  struct pair *pairs;
+  int i;
+
+  if ((count == 0) || (count % 2))
+    fatal (1, NULL);
+  count /= 2;
+
+  src = calloc (count, sizeof (tape_handle_t));
+  pairs = calloc (count, sizeof (struct pair));
+  if (! src || ! pairs)
+    fatal (2, "can't allocate pair table\n");
+
+  for (i = 0; i < count; i++)
+    {
+      pairs [i].srcfn = fns [2 * i];
+      pairs [i].prevlen = -1;
+      src [i] = opentape (fns [2 * i], 0, 0);
+      if (! src [i])
+	fatal (3, "can't open source tape %s\n", fns [2 * i]);
+      pairs [i].dest = opentape (fns [2 * i + 1], 1, 1);
+      if (! pairs [i].dest)
+	fatal (4, "can't open dest tape %s\n", fns [2 * i + 1]);
+    }
+
+  tapeloop (src, count, MAX_REC_LEN, copy_pair_rec, pairs);
+
+  for (i = 0; i < count; i++)
+    {
+      closetape (src [i]);
+      closetape (pairs [i].dest);
+    }
+
+  return (0);
+}
+
+/* queue of records read but not yet written to every destination; an
+   entry with length 0 is a tape mark, and -1 marks the end of the copy */
+struct qent
+{
+  char *buf;
+  int len;
+};
+
+struct queue
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;		/* head or tail moved */
+  struct qent *ent;
+  int size;			/* number of entries */
+  u64 head;			/* count of entries filled by reader */
+  u64 *tail;		/* count of entries emptied by each writer */
+  int writers;
+} queue;
+
+tape_handle_t *dest;
+char **destfn;
+
+
+/* structured statistics (--stats): one JSON object per line, for the
+   read side at each tape file, for each destination's write side at each
+   tape file, and for the whole tape at the end */
+FILE *stats = NULL;
+
+struct side_stats
+{
+  u64 records;
+  u64 bytes;
+  double seconds;		/* spent in tape I/O calls */
+};
+
+struct side_stats read_file, read_tape;	/* reader, this file and all */
+struct side_stats *write_tape;		/* each writer, all files */
+
+/* record lengths seen in the current file, and how many of each */
+int hist_n = 0;
+int hist_size = 0;
+int *hist_len;
+u64 *hist_count;
+
+double start_time;
+
+
+double now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, & ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+double mbps (struct side_stats *s)
+{
+  return (s->seconds > 0) ? s->bytes / s->seconds / 1e6 : 0;
+}
+
+
+/* write a string as a JSON string */
+void json_string (FILE *f, char *s)
+{
+  putc ('"', f);
+  for (; *s; s++)
+    {
+      if (*s == '"' || *s == '\\')
+	fprintf (f, "\\%c", *s);
+      else if ((unsigned char) *s < ' ')
+	fprintf (f, "\\u%04x", *s);
+      else
+	putc (*s, f);
+    }
+  putc ('"', f);
+}
+
+
+void count_length (int len)
+{
+  int i;
+
+  for (i = 0; i < hist_n; i++)
+    if (hist_len [i] == len)
+      {
+	hist_count [i]++;
+	return;
+      }
+  if (hist_n == hist_size)
+    {
+      hist_size = hist_size ? 2 * hist_size : 16;
+      hist_len = realloc (hist_len, hist_size * sizeof (int));
+      hist_count = realloc (hist_count, hist_size * sizeof (u64));
+      if (! hist_len || ! hist_count)
+	fatal (2, "can't allocate histogram\n");
+    }
+  hist_len [hist_n] = len;
+  hist_count [hist_n++] = 1;
+}
+
+
+/* account for one record or tape mark read, taking "seconds" */
+void stats_read (int file, int len, double seconds)
+{
+  int i;
+
+  read_file.seconds += seconds;
+  if (len != 0)
+    {
+      read_file.records++;
+      read_file.bytes += len;
+      count_length (len);
+      return;
+    }
+
+  flockfile (stats);
+  fprintf (stats, "{\"type\":\"read\",\"file\":%d,\"records\":%llu,"
+	   "\"bytes\":%llu,\"seconds\":%.6f,\"mbps\":%.3f,\"lengths\":{",
+	   file, read_file.records, read_file.bytes, read_file.seconds,
+	   mbps (& read_file));
+  for (i = 0; i < hist_n; i++)
+    fprintf (stats, "%s\"%d\":%llu", i ? "," : "", hist_len [i],
+	     hist_count [i]);
+  fprintf (stats, "}}\n");
+  fflush (stats);
+  funlockfile (stats);
+
+  read_tape.records += read_file.records;
+  read_tape.bytes += read_file.bytes;
+  read_tape.seconds += read_file.seconds;
+  memset (& read_file, 0, sizeof (read_file));
+  hist_n = 0;
+}
+
+
+/* report one destination's write side of one tape file */
+void stats_write (int w, int file, struct side_stats *s)
+{
+  flockfile (stats);
+  fprintf (stats, "{\"type\":\"write\",\"dest\":");
+  json_string (stats, destfn [w]);
+  fprintf (stats, ",\"file\":%d,\"records\":%llu,\"bytes\":%llu,"
+	   "\"seconds\":%.6f,\"mbps\":%.3f}\n",
+	   file, s->records, s->bytes, s->seconds, mbps (s));
+  fflush (stats);
+  funlockfile (stats);
+
+  write_tape [w].records += s->records;
+  write_tape [w].bytes += s->bytes;
+  write_tape [w].seconds += s->seconds;
+  memset (s, 0, sizeof (*s));
+}
+
+
+/* report the whole tape */
+void stats_tape (int files, int ndest)
+{
+  int w;
+
+  fprintf (stats, "{\"type\":\"tape\",\"files\":%d,\"records\":%llu,"
+	   "\"bytes\":%llu,\"wall_seconds\":%.6f,\"read_seconds\":%.6f,"
+	   "\"read_mbps\":%.3f,\"write\":[",
+	   files, read_tape.records, read_tape.bytes, now () - start_time,
+	   read_tape.seconds, mbps (& read_tape));
+  for (w = 0; w < ndest; w++)
+    {
+      fprintf (stats, "%s{\"dest\":", w ? "," : "");
+      json_string (stats, destfn [w]);
+      fprintf (stats, ",\"records\":%llu,\"bytes\":%llu,\"seconds\":%.6f,"
+	       "\"mbps\":%.3f}", write_tape [w].records, write_tape [w].bytes,
+	       write_tape [w].seconds, mbps (& write_tape [w]));
+    }
+  fprintf (stats, "]}\n");
+  fflush (stats);
+}
+
+
+/* checkpoint journal for a copy to an image file, with lines giving the
+   tape file, record within file, destination offset, bytes copied of
+   that file, and bytes copied of previous files */
+FILE *journal = NULL;
+
+/* where a resumed copy starts */
+int resume_file = 0;
+u64 resume_record = 0;
+u64 resume_filebytes = 0;
+u64 resume_tapebytes = 0;
+
+
+/* note that everything up to the given position has been copied */
+void checkpoint (int file, u64 record, u64 filebytes, u64 tapebytes)
+{
+  int fd = tapeimagefd (dest [0]);
+
+  fdatasync (fd);
+  fprintf (journal, "%d %llu %lld %llu %llu\n", file, record,
+	   (long long) lseek (fd, 0, SEEK_CUR), filebytes, tapebytes);
+  fflush (journal);
+}
+
+
+/* read the last checkpoint from the journal, and truncate the
+   destination to it; return 0 if there's nothing to resume from, or the
+   destination doesn't have everything the checkpoint says was copied */
+int resume_position (char *journalfn)
+{
+  FILE *f;
+  char line [200];
+  int file;
+  u64 record;
+  long long offset;
+  u64 filebytes, tapebytes;
+  int found = 0;
+  int fd;
+  struct stat st;
+
+  f = fopen (journalfn, "r");
+  if (! f)
+    return (0);
+  while (fgets (line, sizeof (line), f))
+    if (sscanf (line, "%d %llu %lld %llu %llu", & file, & record, & offset,
+		& filebytes, & tapebytes) == 5)
+      found = 1;
+  fclose (f);
+  if (! found)
+    return (0);
+
+  fd = tapeimagefd (dest [0]);
+  if (fstat (fd, & st) < 0 || st.st_size < offset)
+    {
+      fprintf (stderr, "%s: dest tape is shorter than the journal says, "
+	       "starting over\n", progname);
+      return (0);
+    }
+  resume_file = file;
+  resume_record = record;
+  resume_filebytes = filebytes;
+  resume_tapebytes = tapebytes;
+  if (ftruncate (fd, offset) < 0 || lseek (fd, offset, SEEK_SET) != offset)
+    fatal (4, "can't truncate dest tape to checkpoint: %s\n",
+	   strerror (errno));
+  return (1);
+}
+
+
+void queue_init (int writers)
+{
+  int i;
+
+  queue.writers = writers;
+  queue.tail = calloc (writers, sizeof (u64));
+  if (! queue.tail)
+    fatal (2, "can't allocate queue\n");
+
+  queue.size = QUEUE_ENTRIES;
+  queue.ent = calloc (queue.size, sizeof (struct qent));
+  if (! queue.ent)
+    fatal (2, "can't allocate queue\n");
+  for (i = 0; i < queue.size; i++)
+    {
+      queue.ent [i].buf = malloc (MAX_REC_LEN);
+      if (! queue.ent [i].buf)
+	fatal (2, "can't allocate buffer\n");
+    }
+  pthread_mutex_init (& queue.lock, NULL);
+  pthread_cond_init (& queue.cond, NULL);
+}
+
+
+/* entries not yet emptied by the slowest writer */
+unsigned long queue_used (void)
+{
+  unsigned long used = 0;
+  int i;
+
+  for (i = 0; i < queue.writers; i++)
+    if (queue.head - queue.tail [i] > used)
+      used = queue.head - queue.tail [i];
+  return (used);
+}
+
+
+/* wait for an entry every writer is finished with, and return its buffer
+   for the reader to fill */
+char *queue_free_buf (void)
+{
+  pthread_mutex_lock (& queue.lock);
+  while (queue_used () == queue.size)
+    pthread_cond_wait (& queue.cond, & queue.lock);
+  pthread_mutex_unlock (& queue.lock);
+  return (queue.ent [queue.head % queue.size].buf);
+}
+
+
+/* pass the entry just filled to the writer */
+void queue_put (int len)
+{
+  pthread_mutex_lock (& queue.lock);
+  queue.ent [queue.head % queue.size].len = len;
+  queue.head++;
+  pthread_cond_broadcast (& queue.cond);
+  pthread_mutex_unlock (& queue.lock);
+}
+
+
+/* writer thread: write queued records and tape marks to one destination */
+void *writer (void *arg)
+{
+  int w = (long) arg;
+  struct qent *ent;
+  int len;
+  int file = resume_file;
+  u64 record = resume_record;
+  u64 filebytes = resume_filebytes;
+  u64 tapebytes = resume_tapebytes;
+  int prevlen = (file > 0 && record == 0) ? 0 : -1;
+  struct side_stats ws;
+  double t = 0;
+
+  memset (& ws, 0, sizeof (ws));
+
+  for (;;)
+    {
+      pthread_mutex_lock (& queue.lock);
+      while (queue.tail [w] == queue.head)
+	pthread_cond_wait (& queue.cond, & queue.lock);
+      pthread_mutex_unlock (& queue.lock);
+
+      ent = & queue.ent [queue.tail [w] % queue.size];
+      len = ent->len;
+      if (stats)
+	t = now ();
+      if (len > 0)
+	{
+	  putrec (dest [w], ent->buf, len);
+	  if (stats)
+	    {
+	      ws.seconds += now () - t;
+	      ws.records++;
+	      ws.bytes += len;
+	    }
+	  filebytes += len;
+	  record++;
+	  if (journal && (record % JOURNAL_INTERVAL == 0))
+	    checkpoint (file, record, filebytes, tapebytes);
+	}
+      else if (len == 0)
+	{
+	  tapemark (dest [w]);
+	  if (stats && prevlen == 0)	/* end of tape, not a file */
+	    write_tape [w].seconds += now () - t;
+	  else if (stats)
+	    {
+	      ws.seconds += now () - t;
+	      stats_write (w, file, & ws);
+	    }
+	  tapebytes += filebytes;
+	  filebytes = 0;
+	  record = 0;
+	  file++;
+	  if (journal)
+	    checkpoint (file, record, filebytes, tapebytes);
+	}
+
+      pthread_mutex_lock (& queue.lock);
+      queue.tail [w]++;
+      pthread_cond_broadcast (& queue.cond);
+      pthread_mutex_unlock (& queue.lock);
+
+      if (len < 0)
+	return (NULL);
+      prevlen = len;
+    }
+}
+
+
+/* reblocking: "block_count" consecutive records of the same length are
+   packed into one (-b), or records that are a multiple of "unblock_size"
+   are split into records of that size (-u); records made of Dumper or
+   BACKUP blocks are packed into at most the 64 blocks read20 and
+   t10backup take in one record */
+#define DUMPER_BLOCK (518 * 5)		/* see dumper.h */
+#define BACKUP_BLOCK (5 * (32 + 512))	/* see t10backup.c */
+#define MAX_PACKED_BLOCKS 64
+
+int block_count = 0;
+int unblock_size = 0;
+
+char *pack_buf;			/* queue buffer records are packed into */
+int pack_len = 0;		/* bytes packed so far */
+int pack_count = 0;		/* records packed so far */
+int pack_reclen;		/* length of records being packed */
+
+
+/* pass on the record being packed, if any */
+void flush_packed (void)
+{
+  if (pack_count)
+    {
+      queue_put (pack_len);
+      pack_len = 0;
+      pack_count = 0;
+    }
+}
+
+
+/* queue a source record for writing, reblocking it as asked */
+void put_reblocked (char *rec, int len)
+{
+  int i;
+  int limit = MAX_REC_LEN;
+
+  if (block_count > 1)
+    {
+      if (len % DUMPER_BLOCK == 0)
+	limit = MAX_PACKED_BLOCKS * DUMPER_BLOCK;
+      else if (len % BACKUP_BLOCK == 0)
+	limit = MAX_PACKED_BLOCKS * BACKUP_BLOCK;
+      if (pack_count && ((len != pack_reclen) ||
+			 (pack_count == block_count) ||
+			 (pack_len + len > limit)))
+	flush_packed ();
+      if (! pack_count)
+	pack_buf = queue_free_buf ();
+      memcpy (pack_buf + pack_len, rec, len);
+      pack_len += len;
+      pack_count++;
+      pack_reclen = len;
+    }
+  else if (unblock_size && (len > unblock_size) && (len % unblock_size == 0))
+    {
+      for (i = 0; i < len; i += unblock_size)
+	{
+	  memcpy (queue_free_buf (), rec + i, unblock_size);
+	  queue_put (unblock_size);
+	}
+    }
+  else
+    {
+      memcpy (queue_free_buf (), rec, len);
+      queue_put (len);
+    }
+}
+
+
+/* the writer threads, and the thread that reads the source for them */
+pthread_t *writer_thread = NULL;
+pthread_t reader_thread;
+int writers_running = 0;
+
+
+/* end the queue and wait for every writer to empty it */
+void finish_writers (int ndest)
+{
+  int i;
+
+  writers_running = 0;
+  queue_free_buf ();
+  queue_put (-1);
+  for (i = 0; i < ndest; i++)
+    pthread_join (writer_thread [i], NULL);
+}
+
+
+/* tapeio exits on a source error; let the writers finish what was read
+   before that, as a record at a time copy would have */
+void drain_writers (void)
+{
+  if (! writers_running || ! pthread_equal (pthread_self (), reader_thread))
+    return;
+  flush_packed ();
+  finish_writers (queue.writers);
+}
+
+
+/* image-to-image fast path: the source framing is checked a record at a
+   time, and the bytes are moved from file to file by the kernel */
+int fast_srcfd = -1;
+int fast_destfd;
+off_t fast_copied;		/* source offset copied up to */
+off_t fast_validated;		/* end of the last record checked */
+int fast_records;		/* records checked but not copied */
+
+
+/* copy the source image from where we left off up to "end" */
+void fast_copy (off_t end)
+{
+  off_t n;
+
+  if (fast_copied >= end)
+    return;
+  n = tapeimagecopy (fast_srcfd, fast_copied, fast_destfd, end - fast_copied);
+  if (n < 0)
+    fatal (5, "can't copy image: %s\n", strerror (errno));
+  if (n < end - fast_copied)
+    fatal (5, "unexpected end of source image\n");
+  fast_copied = end;
+}
+
+
+/* tapeio exits on a framing error in the source; before that happens,
+   copy whatever was validated, as a record at a time copy would have */
+void fast_salvage (void)
+{
+  if (fast_srcfd < 0 || fast_copied >= fast_validated)
+    return;
+  if (tapeimagecopy (fast_srcfd, fast_copied, fast_destfd,
+		     fast_validated - fast_copied) < 0)
+    fprintf (stderr, "%s: can't copy image: %s\n", progname,
+	     strerror (errno));
+  fast_copied = fast_validated;
+}
+
+
+/* copy the tape file the fast path just reached the end of, so its write
+   side can be timed */
+void fast_copy_file (int file, u64 records, u64 bytes)
+{
+  struct side_stats ws;
+  double t = now ();
+
+  fast_copy (lseek (fast_srcfd, 0, SEEK_CUR));
+  ws.records = records;
+  ws.bytes = bytes;
+  ws.seconds = now () - t;
+  stats_write (0, file, & ws);
+}
+
+
+/* delta mode (--delta): bring an existing destination image up to date
+   with the source, rewriting only the tape files that differ; each tape
+   file is the span of image bytes up to and including its tape mark */
+struct span
+{
+  off_t start;
+  off_t end;
+  u64 hash;
+};
+
+
+/* 64-bit FNV-1a of an image file's bytes from start to end */
+u64 hash_span (int fd, off_t start, off_t end)
+{
+  u64 h = 0xcbf29ce484222325ULL;
+  ssize_t n, i;
+  unsigned char *p = (unsigned char *) buf;
+
+  while (start < end)
+    {
+      n = pread (fd, buf, (end - start > MAX_REC_LEN) ? MAX_REC_LEN
+		 : end - start, start);
+      if (n <= 0)
+	fatal (5, "can't read image: %s\n", n ? strerror (errno) : "EOF");
+      for (i = 0; i < n; i++)
+	h = (h ^ p [i]) * 0x100000001b3ULL;
+      start += n;
+    }
+  return (h);
+}
+
+
+/* find the tape files of an image, up to the end of tape, and hash
+   them; return the count, or with "check" set, -1 if the image is
+   truncated or corrupt rather than exiting */
+int scan_image (char *fn, struct span **spans, int check)
+{
+  tape_handle_t t;
+  int fd;
+  int n = 0;
+  int size = 0;
+  int len, prevlen = -1;
+  off_t start;
+
+  t = opentape (fn, 0, 0);
+  if (! t || (fd = tapeimagefd (t)) < 0)
+    fatal (1, "%s is not an image file\n", fn);
+  start = lseek (fd, 0, SEEK_CUR);
+  *spans = NULL;
+  for (;;)
+    {
+      len = check ? tapeimagereclen (t) : getreclen (t, NULL);
+      if (len < 0)
+	{
+	  closetape (t);
+	  free (*spans);
+	  *spans = NULL;
+	  return (-1);
+	}
+      if (len == 0)
+	{
+	  if (n == size)
+	    {
+	      size = size ? 2 * size : 64;
+	      *spans = realloc (*spans, size * sizeof (struct span));
+	      if (! *spans)
+		fatal (2, "can't allocate span table\n");
+	    }
+	  (*spans) [n].start = start;
+	  (*spans) [n].end = start = lseek (fd, 0, SEEK_CUR);
+	  (*spans) [n].hash = hash_span (fd, (*spans) [n].start, start);
+	  n++;
+	  if (prevlen == 0)
+	    break;
+	}
+      prevlen = len;
+    }
+  closetape (t);
+  return (n);
+}
+
+
+/* the spans of the destination recorded by the last delta copy, if that
+   is newer than the destination itself */
+int read_sums (char *sumfn, char *destfn, struct span **spans)
+{
+  struct stat sst, dst;
+  FILE *f;
+  char line [200];
+  int n = 0;
+  long long start, end, eot = -1;
+  u64 hash;
+
+  if (stat (sumfn, & sst) < 0 || stat (destfn, & dst) < 0 ||
+      sst.st_mtime < dst.st_mtime)
+    return (-1);
+  f = fopen (sumfn, "r");
+  if (! f)
+    return (-1);
+  *spans = NULL;
+  while (fgets (line, sizeof (line), f))
+    {
+      if (sscanf (line, "eot %lld", & eot) == 1)
+	break;
+      if (sscanf (line, "%*d %lld %lld %llx", & start, & end, & hash) != 3)
+	break;
+      *spans = realloc (*spans, (n + 1) * sizeof (struct span));
+      if (! *spans)
+	fatal (2, "can't allocate span table\n");
+      (*spans) [n].start = start;
+      (*spans) [n].end = end;
+      (*spans) [n].hash = hash;
+      n++;
+    }
+  fclose (f);
+  if (eot != dst.st_size)
+    {
+      free (*spans);
+      return (-1);
+    }
+  return (n);
+}
+
+
+int copy_delta (char *srcfn, char *destfn)
+{
+  struct span *src, *old = NULL;
+  int nsrc, nold = 0;
+  int i, same;
+  off_t end;
+  char *sumfn;
+  FILE *f;
+  int rewritten = 0;
+
+  buf = malloc (MAX_REC_LEN);
+  sumfn = malloc (strlen (destfn) + sizeof (".sum"));
+  if (! buf || ! sumfn)
+    fatal (2, "can't allocate buffer\n");
+  sprintf (sumfn, "%s.sum", destfn);
+
+  nsrc = scan_image (srcfn, & src, 0);
+  if (access (destfn, F_OK) == 0 &&
+      (nold = read_sums (sumfn, destfn, & old)) < 0 &&
+      (nold = scan_image (destfn, & old, 1)) < 0)
+    {			/* every file differs */
+      fprintf (stderr, "%s: can't read dest tape %s, copying all of it\n",
+	       progname, destfn);
+      nold = 0;
+    }
+
+  fast_srcfd = open (srcfn, O_RDONLY);
+  if (fast_srcfd < 0)
+    fatal (3, "can't open source tape\n");
+  fast_destfd = open (destfn, O_RDWR | O_CREAT, 0666);
+  if (fast_destfd < 0)
+    fatal (4, "can't open dest tape %s\n", destfn);
+
+  /* files are rewritten in place; once one changes size, everything
+     after it has moved, and is copied from the source */
+  same = 1;
+  for (i = 0; i < nsrc; i++)
+    {
+      same = same && i < nold && src [i].start == old [i].start &&
+	src [i].end == old [i].end;
+      if (same && src [i].hash == old [i].hash)
+	{
+	  if (verbose)
+	    printf ("file %d unchanged\n", i);
+	  continue;
+	}
+      if (verbose)
+	printf ("file %d rewritten\n", i);
+      fast_copied = src [i].start;
+      if (lseek (fast_destfd, fast_copied, SEEK_SET) < 0)
+	fatal (4, "can't seek dest tape\n");
+      fast_copy (src [i].end);
+      rewritten++;
+    }
+
+  /* the extra tape mark closetape() would have added */
+  end = nsrc ? src [nsrc - 1].end : 0;
+  memset (buf, 0, 4);
+  if (pwrite (fast_destfd, buf, 4, end) != 4 ||
+      ftruncate (fast_destfd, end + 4) < 0 ||
+      fsync (fast_destfd) < 0)
+    fatal (4, "can't write dest tape: %s\n", strerror (errno));
+  close (fast_destfd);
+  close (fast_srcfd);
+
+  f = fopen (sumfn, "w");
+  if (f)
+    {
+      for (i = 0; i < nsrc; i++)
+	fprintf (f, "%d %lld %lld %016llx\n", i, (long long) src [i].start,
+		 (long long) src [i].end, src [i].hash);
+      fprintf (f, "eot %lld\n", (long long) end + 4);
+      fclose (f);
+    }
+
+  if (verbose)
+    printf ("%d of %d files rewritten\n", rewritten, nsrc);
+  return (0);
+}
+
+/* batch mode (--batch): each line of the manifest names a source and
+   its destinations, and the copies are run in forked children, so that
+   a job that fails (tapeio exits on errors) takes only itself down */
+struct job
+{
+  char *srcfn;
+  char **destfn;
+  int ndest;
+  pid_t pid;			/* 0 if not started, -1 if finished */
+};
+
+struct job *jobs;
+int njobs = 0;
+
+
+/* drives, local or remote, take one job at a time; image files don't */
+int is_drive (char *fn)
+{
+  return ((strncmp (fn, "/dev/", 5) == 0) || (strchr (fn, ':') != NULL));
+}
+
+
+int uses_drive (struct job *j, char *fn)
+{
+  int i;
+
+  if (strcmp (j->srcfn, fn) == 0)
+    return (1);
+  for (i = 0; i < j->ndest; i++)
+    if (strcmp (j->destfn [i], fn) == 0)
+      return (1);
+  return (0);
+}
+
+
+/* can job j start while the running jobs hold their drives? */
+int drives_free (struct job *j)
+{
+  int i, k;
+
+  for (i = 0; i < njobs; i++)
+    {
+      if (jobs [i].pid <= 0)
+	continue;
+      if (is_drive (j->srcfn) && uses_drive (& jobs [i], j->srcfn))
+	return (0);
+      for (k = 0; k < j->ndest; k++)
+	if (is_drive (j->destfn [k]) && uses_drive (& jobs [i], j->destfn [k]))
+	  return (0);
+    }
+  return (1);
+}
+
+
+void read_manifest (char *fn)
+{
+  FILE *f;
+  char *line = NULL;
+  size_t size = 0;
+  int lineno = 0;
+  int size_jobs = 0;
+  char *tok;
+  struct job *j;
+
+  if (strcmp (fn, "-") == 0)
+    f = stdin;
+  else if (! (f = fopen (fn, "r")))
+    fatal (2, "can't open manifest %s\n", fn);
+
+  while (getline (& line, & size, f) >= 0)
+    {
+      lineno++;
+      tok = strtok (line, " \t\n");
+      if (! tok || tok [0] == '#')
+	continue;
+      if (njobs == size_jobs)
+	{
+	  size_jobs = size_jobs ? 2 * size_jobs : 64;
+	  jobs = realloc (jobs, size_jobs * sizeof (struct job));
+	  if (! jobs)
+	    fatal (2, "can't allocate job table\n");
+	}
+      j = & jobs [njobs];
+      j->srcfn = strdup (tok);
+      j->destfn = NULL;
+      j->ndest = 0;
+      j->pid = 0;
+      while ((tok = strtok (NULL, " \t\n")))
+	{
+	  j->destfn = realloc (j->destfn, (j->ndest + 1) * sizeof (char *));
+	  if (! j->destfn)
+	    fatal (2, "can't allocate job table\n");
+	  j->destfn [j->ndest++] = strdup (tok);
+	}
+      if (! j->ndest)
+	fatal (1, "%s line %d: no destination\n", fn, lineno);
+      njobs++;
+    }
+
+  free (line);
+  if (f != stdin)
+    fclose (f);
+}
+
+
+/* run the jobs, at most maxjobs at a time; returns in the child for each
+   job, with the source and destinations filled in, and exits in the
+   parent when all of them are done */
+int run_batch (char *manifest, int maxjobs, char **srcfn)
+{
+  int running = 0;
+  int done = 0;
+  int failed = 0;
+  int next = 0;			/* first job not yet started */
+  int status;
+  pid_t pid;
+  int i;
+
+  read_manifest (manifest);
+
+  while (done < njobs)
+    {
+      /* start whatever can be started, in manifest order */
+      for (i = next; i < njobs && running < maxjobs; i++)
+	{
+	  if (jobs [i].pid != 0 || ! drives_free (& jobs [i]))
+	    continue;
+	  fflush (stdout);
+	  if (stats)
+	    fflush (stats);
+	  pid = fork ();
+	  if (pid < 0)
+	    fatal (2, "can't fork\n");
+	  if (pid == 0)
+	    {
+	      *srcfn = jobs [i].srcfn;
+	      destfn = jobs [i].destfn;
+	      return (jobs [i].ndest);
+	    }
+	  jobs [i].pid = pid;
+	  running++;
+	  if (verbose)
+	    printf ("[%d/%d] started %s\n", done, njobs, jobs [i].srcfn);
+	}
+      while (next < njobs && jobs [next].pid != 0)
+	next++;
+
+      if (! running)
+	break;
+      pid = wait (& status);
+      if (pid < 0)
+	fatal (2, "can't wait for jobs\n");
+      for (i = 0; i < njobs && jobs [i].pid != pid; i++)
+	;
+      if (i == njobs)
+	continue;
+      jobs [i].pid = -1;
+      running--;
+      done++;
+      if (WIFEXITED (status) && WEXITSTATUS (status) == 0)
+	printf ("[%d/%d] done %s\n", done, njobs, jobs [i].srcfn);
+      else
+	{
+	  failed++;
+	  if (WIFEXITED (status))
+	    printf ("[%d/%d] FAILED %s, exit status %d\n", done, njobs,
+		    jobs [i].srcfn, WEXITSTATUS (status));
+	  else
+	    printf ("[%d/%d] FAILED %s, signal %d\n", done, njobs,
+		    jobs [i].srcfn, WTERMSIG (status));
+	}
+      fflush (stdout);
+    }
+
+  printf ("%d jobs, %d copied, %d failed\n", njobs, done - failed, failed);
+  exit (failed ? 5 : 0);
+}
+
+
 int main (int argc, char *argv[])
 {
   int file = 0;
-  unsigned long filebytes = 0;
-  unsigned long tapebytes = 0;
+  u64 filebytes = 0;
+  u64 tapebytes = 0;
+  u64 records = 0;
   int prevlen = -2;
-  int lencount = 0;
-  int firstrec = 0;
+  u64 lencount = 0;
+  u64 firstrec = 0;
+  u64 skip;
+  int n;
   int len;
-  int verbose = 0;
+  int multiplex = 0;
+  int journaling = 0;
+  int reblocking = 0;
+  int resume = 0;
+  int delta = 0;
+  char *journalfn = NULL;
   char *srcfn = NULL;
-  char *destfn = NULL;
+  char *manifest = NULL;
+  int maxjobs = 1;
+  int ndest = 0;
+  double t = 0;
+  int i;
   tape_handle_t src = NULL;
-  tape_handle_t dest = NULL;
 
   progname = argv [0];
 
+  destfn = calloc (argc, sizeof (char *));
+  if (! destfn)
+    fatal (2, "can't allocate destination table\n");
+
   while (++argv, --argc)
     {
       if ((argv [0][0] == '-') && (argv [0][1] != '\0'))
 	{
-	  if (argv [0][1] == 'v')
+	  if (strcmp (argv [0], "--journal") == 0)
+	    journaling = 1;
+	  else if (strcmp (argv [0], "--resume") == 0)
+	    journaling = resume = 1;
+	  else if (strcmp (argv [0], "--stats") == 0)
+	    {
+	      if (! --argc)
+		fatal (1, "missing stats file name\n");
+	      ++argv;
+	      if (strcmp (argv [0], "-") == 0)
+		stats = stdout;
+	      else if (! (stats = fopen (argv [0], "w")))
+		fatal (2, "can't create %s\n", argv [0]);
+	    }
+	  else if (strcmp (argv [0], "--delta") == 0)
+	    delta = 1;
+	  else if (strcmp (argv [0], "--batch") == 0)
+	    {
+	      if (! --argc)
+		fatal (1, "missing manifest file name\n");
+	      manifest = (++argv) [0];
+	    }
+	  else if (argv [0][1] == 'v')
 	    verbose++;
+	  else if (argv [0][1] == 'j')
+	    {
+	      if (! --argc)
+		fatal (1, "missing job count\n");
+	      maxjobs = atoi ((++argv) [0]);
+	      if (maxjobs <= 0)
+		fatal (1, "bad job count '%s'\n", argv [0]);
+	    }
+	  else if (argv [0][1] == 'm')
+	    multiplex = 1;
+	  else if (argv [0][1] == 'b' || argv [0][1] == 'u')
+	    {
+	      if (! --argc)
+		fatal (1, "missing argument to '%s'\n", argv [0]);
+	      if (argv [0][1] == 'b')
+		block_count = atoi ((++argv) [0]);
+	      else
+		unblock_size = atoi ((++argv) [0]);
+	      if (atoi (argv [0]) <= 0)
+		fatal (1, "bad reblocking argument '%s'\n", argv [0]);
+	    }
 	  else
 	    fatal (1, "unrecognized option '%s'\n", argv [0]);
 	}
+      else if (multiplex)
+	return (copy_multiplexed (argc, argv));
       else if (! srcfn)
 	srcfn = argv [0];
-      else if (! destfn)
-	destfn = argv [0];
       else
-	fatal (1, NULL);
+	destfn [ndest++] = argv [0];
+    }
+
+  if (manifest)
+    {
+      if (srcfn || multiplex)
+	fatal (1, "--batch takes its tapes from the manifest\n");
+      if (stats && stats != stdout)
+	setvbuf (stats, NULL, _IOLBF, 0);
+      ndest = run_batch (manifest, maxjobs, & srcfn);
     }
 
   if (! srcfn)
     fatal (1, NULL);
 
-  buf = malloc (MAX_REC_LEN);
-  if (! buf)
-    fatal (2, "can't allocate buffer\n");
+  if (block_count && unblock_size)
+    fatal (1, "can't both pack and split records\n");
+  reblocking = block_count > 1 || unblock_size;
+  if (reblocking && journaling)
+    fatal (1, "can't journal a reblocked copy\n");
+
+  if (delta)
+    {
+      if (ndest != 1 || journaling || reblocking)
+	fatal (1, "--delta copies one image to one image\n");
+      return (copy_delta (srcfn, destfn [0]));
+    }
+
+  start_time = now ();
+  write_tape = calloc (ndest + 1, sizeof (struct side_stats));
+  if (! write_tape)
+    fatal (2, "can't allocate statistics\n");
 
   src = opentape (srcfn, 0, 0);
   if (! src)
     fatal (3, "can't open source tape\n");
 
-  if (destfn)
+  if (ndest)
     {
-      dest = opentape (destfn, 1, 1);
+      dest = calloc (ndest, sizeof (tape_handle_t));
       if (! dest)
-	fatal (4, "can't open dest tape\n");
+	fatal (2, "can't allocate destination table\n");
+      for (i = 0; i < ndest; i++)
+	{
+	  dest [i] = opentape (destfn [i],
+			       ! (resume && access (destfn [i], F_OK) == 0), 1);
+	  if (! dest [i])
+	    fatal (4, "can't open dest tape %s\n", destfn [i]);
+	}
+    }
+
+  /* a copy to an image file can be journaled, and resumed from the last
+     checkpoint after being interrupted */
+  if (journaling)
+    {
+      if (ndest != 1 || tapeimagefd (dest [0]) < 0)
+	fatal (1, "journal needs a single image file destination\n");
+      journalfn = malloc (strlen (destfn [0]) + sizeof (".journal"));
+      if (! journalfn)
+	fatal (2, "can't allocate journal name\n");
+      sprintf (journalfn, "%s.journal", destfn [0]);
+      if (resume && resume_position (journalfn))
+	{
+	  skipfile (src, resume_file);
+	  for (skip = resume_record; skip > 0; skip -= n)
+	    {			/* skiprec() takes an int */
+	      n = (skip > INT_MAX) ? INT_MAX : skip;
+	      skiprec (src, n);
+	    }
+	  file = resume_file;
+	  firstrec = resume_record;
+	  filebytes = resume_filebytes;
+	  tapebytes = resume_tapebytes;
+	  if (file > 0 && firstrec == 0)
+	    prevlen = 0;	/* just after a tape mark */
+	  if (verbose)
+	    printf ("resuming at file %d record %llu\n", file, firstrec);
+	  journal = fopen (journalfn, "a");
+	}
+      else
+	{
+	  if (resume && ftruncate (tapeimagefd (dest [0]), 0) < 0)
+	    fatal (4, "can't truncate dest tape\n");
+	  journal = fopen (journalfn, "w");
+	}
+      if (! journal)
+	fatal (4, "can't open journal %s\n", journalfn);
+    }
+
+  /* a plain image copied to a single plain image needs no parsing */
+  if (ndest == 1 && ! reblocking && tapeimagefd (src) >= 0)
+    {
+      if ((fast_destfd = tapeimagefd (dest [0])) >= 0)
+	{
+	  fast_srcfd = tapeimagefd (src);
+	  fast_copied = fast_validated = lseek (fast_srcfd, 0, SEEK_CUR);
+	  atexit (fast_salvage);
+	  buf = malloc (MAX_REC_LEN);
+	  if (! buf)
+	    fatal (2, "can't allocate buffer\n");
+	}
+    }
+
+  /* otherwise the source is read once, here, while a separate thread
+     writes each destination; the slowest destination holds up the reader */
+  if (fast_srcfd >= 0)
+    ;
+  else if (ndest)
+    {
+      writer_thread = calloc (ndest, sizeof (pthread_t));
+      if (! writer_thread)
+	fatal (2, "can't allocate destination table\n");
+      queue_init (ndest);
+      for (i = 0; i < ndest; i++)
+	{
+	  if (pthread_create (& writer_thread [i], NULL, writer,
+			      (void *) (long) i) != 0)
+	    fatal (2, "can't start writer thread\n");
+	}
+      reader_thread = pthread_self ();
+      writers_running = 1;
+      atexit (drain_writers);
     }
   else
     verbose++;
 
+  /* records are read into a buffer of their own if they have to be
+     reblocked on the way into the queue */
+  if ((fast_srcfd < 0) && reblocking && ndest)
+    {
+      buf = malloc (MAX_REC_LEN);
+      if (! buf)
+	fatal (2, "can't allocate buffer\n");
+    }
+
   for (;;)
     {
-      len = getrec (src, buf, MAX_REC_LEN);
+      /* with nothing to write, only the lengths are needed, and an image
+	 file's data can be skipped over; the read is timed only once any
+	 wait for a free queue buffer is over */
+      if (ndest && fast_srcfd < 0 && ! reblocking)
+	buf = queue_free_buf ();
+      if (stats)
+	t = now ();
+      if (fast_srcfd >= 0)
+	{
+	  len = getreclen (src, NULL);
+	  fast_validated = lseek (fast_srcfd, 0, SEEK_CUR);
+	}
+      else if (! ndest)
+	len = getreclen (src, NULL);
+      else
+	len = getrec (src, buf, MAX_REC_LEN);
+      if (stats && len == 0 && prevlen == 0)	/* end of tape, not a file */
+	read_tape.seconds += now () - t;
+      else if (stats)
+	stats_read (file, len, now () - t);
       if ((lencount != 0) && ((len == 0) || (len != prevlen)))
 	{
 	  if (verbose)
 	    {
 	      if (lencount == 1)
-		printf ("1 record (%d)\n", firstrec);
+		printf ("1 record (%llu)\n", firstrec);
 	      else
-		printf ("%d records (%d..%d)\n", lencount, firstrec,
+		printf ("%llu records (%llu..%llu)\n", lencount, firstrec,
 			firstrec+lencount-1);
 	      fflush (stdout);
 	    }
-	  filebytes += prevlen * lencount;
+	  filebytes += (u64) prevlen * lencount;
 	  firstrec += lencount;
 	  prevlen = -1;
 	  lencount = 0;
@@ -143,9 +1357,12 @@ int main (int argc, char *argv[])
 		  fflush (stdout);
 		}
 	    }
-	  if (destfn)
-	    putrec (dest, buf, len);
+	  if (ndest && reblocking)
+	    put_reblocked (buf, len);
+	  else if (ndest && fast_srcfd < 0)
+	    queue_put (len);
 	  lencount++;
+	  records++;
 	}
       else
 	{
@@ -153,13 +1370,22 @@ int main (int argc, char *argv[])
 	  if (verbose)
 	    {
 	      if (prevlen == 0)
-		printf ("end of tape, %lu total bytes\n", tapebytes);
+		printf ("end of tape, %llu total bytes\n", tapebytes);
 	      else
-		printf ("end of file %d, %lu bytes\n", file, filebytes);
+		printf ("end of file %d, %llu bytes\n", file, filebytes);
 	      fflush (stdout);
 	    }
-	  if (destfn)
-	    tapemark (dest);
+	  if (ndest && reblocking)
+	    {
+	      flush_packed ();
+	      queue_free_buf ();
+	    }
+	  if (ndest && fast_srcfd < 0)
+	    queue_put (0);
+	  if ((fast_srcfd >= 0) && stats && prevlen != 0)
+	    fast_copy_file (file, firstrec, filebytes);
+	  else if (fast_srcfd >= 0)
+	    fast_copy (fast_validated);
 	  if (prevlen == 0)
 	    break;
 	  file++;
@@ -167,12 +1393,43 @@ int main (int argc, char *argv[])
 	  firstrec = 0;
 	  filebytes = 0;
 	}
+      if ((fast_srcfd >= 0) && (++fast_records >= FAST_COPY_RECORDS ||
+				fast_validated - fast_copied >= FAST_COPY_CHUNK))
+	{
+	  fast_copy (fast_validated);
+	  fast_records = 0;
+	  if (journal)
+	    checkpoint (file, firstrec + lencount,
+			filebytes + (len ? (u64) lencount * len : 0), tapebytes);
+	}
       prevlen = len;
     }
 
+  if (fast_srcfd >= 0)
+    {
+      fast_copy (lseek (fast_srcfd, 0, SEEK_CUR));
+      closetape (dest [0]);
+    }
+
   closetape (src);
-  if (destfn)
-    closetape (dest);
+  if (! ndest)
+    printf ("%d files, %llu records, %llu bytes\n", file, records, tapebytes);
+  if (ndest && fast_srcfd < 0)
+    {
+      finish_writers (ndest);
+      for (i = 0; i < ndest; i++)
+	closetape (dest [i]);
+    }
+
+  if (stats)
+    stats_tape (file, ndest);
+
+  /* finished, nothing left to resume */
+  if (journal)
+    {
+      fclose (journal);
+      unlink (journalfn);
+    }
 
   return (0);
 }
@@ -24,10 +24,11 @@
 
 #include "tapeio.h"
 
-#define MAX_REC_LEN 32768
+#define MAX_REC_LEN TAPE_MAX_REC_LEN
 
 
 typedef unsigned int u32;      /* non-portable!!! */
+typedef unsigned long long u64;
 typedef unsigned char uchar;
 
 
@@ -162,7 +163,7 @@ void dump_hp_2000_hibernate_file_header (FILE *f, uchar *buf, u32 len)
   dump_hp_2000_directory_entry (f, buf);
 }
 
-void dump_hp_2000_hibernate (FILE *f, u32 file, u32 record, uchar *buf, u32 len)
+void dump_hp_2000_hibernate (FILE *f, u32 file, u64 record, uchar *buf, u32 len)
 {
   if ((file > 0) && (record == 0))
     dump_hp_2000_hibernate_file_header (f, buf, len);
@@ -244,7 +245,7 @@ void dump_hp_2000_rel_record (FILE *f, uchar *buf, u32 len)
     }
 }
 
-void dump_hp_2000_mcp (FILE *f, u32 file, u32 record, uchar *buf, u32 len)
+void dump_hp_2000_mcp (FILE *f, u32 file, u64 record, uchar *buf, u32 len)
 {
   if ((len == 10) && (buf [0] == 0x02) && (buf [1] == 0x00) &&
       (buf [2] == 0x04) && (buf [3] == 0x01))
@@ -279,9 +280,9 @@ typedef enum {
 int main (int argc, char *argv[])
 {
   u32 file = 0;
-  u32 record = 0;
-  u32 filebytes = 0;
-  u32 tapebytes = 0;
+  u64 record = 0;
+  u64 filebytes = 0;
+  u64 tapebytes = 0;
   u32 len;
   char *srcfn = NULL;
   tape_handle_t src = NULL;
@@ -337,7 +338,7 @@ int main (int argc, char *argv[])
 	      break;
 	    }
 
-	  printf ("total length of file %d = %d records, %u bytes\n",
+	  printf ("total length of file %d = %llu records, %llu bytes\n",
 		  file, record, filebytes);
 	  tapebytes += filebytes;
 	  file++;
@@ -348,7 +349,7 @@ int main (int argc, char *argv[])
 	}
       else
 	{
-	  printf ("file %d record %d: length %d\n", file, record, len);
+	  printf ("file %d record %llu: length %d\n", file, record, len);
 	  switch (tape_type)
 	    {
 #ifdef HP_2000_SUPPORT
@@ -27,18 +27,30 @@
 */
 
 
+#define _GNU_SOURCE	/* for copy_file_range() */
+
 #include <netdb.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <poll.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>	/* for lseek() SEEK_SET, SEEK_END under Linux */
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
 
 #ifdef _AIX /* maybe this will be enough to make it compile on AIX */
 #include <sys/tape.h>
@@ -77,6 +89,16 @@ struct mtop { int mt_op; int mt_count; };
 #define TT_TAPE  1  /* honest to god tape drive */
 #define TT_IMAGE 2  /* file containing image of a tape */
 #define TT_RMT   3  /* rmt tape server */
+#define TT_SIM   4  /* tape image behind a simulated drive */
+
+/* image files and simulated drives share the image file format */
+#define IS_IMAGE(mtape) ((mtape)->tape_type == TT_IMAGE || \
+			 (mtape)->tape_type == TT_SIM)
+
+
+/* rmt write batching */
+#define RMT_BATCH_BYTES 262144	/* max bytes of W commands corked together */
+#define RMT_MAX_PENDING 64	/* max W commands awaiting acknowledgement */
 
 
 struct mtape_t
@@ -88,9 +110,57 @@ struct mtape_t
 
   unsigned long bpi;	/* tape density (for tape length msg) */
   int waccess;		/* NZ => tape opened for write access access */
-  unsigned long count;	/* count of frames written to tape */
+  unsigned long long count;	/* count of frames written to tape */
 
   char netbuf[80];	/* buffer for net commands and responses */
+
+  /* rmt write-behind: W commands are corked into wbuf, and their
+     acknowledgements are collected later */
+  char *wbuf;		/* corked W commands and data not yet sent */
+  int wlen;		/* bytes used in wbuf */
+  int wacklen [RMT_MAX_PENDING];  /* lengths of unacknowledged writes */
+  int wackhead;		/* index of oldest unacknowledged write */
+  int wackcount;	/* number of unacknowledged writes */
+
+  /* drive model for TT_SIM */
+  double sim_ips;	/* streaming speed, inches per second */
+  double sim_gap;	/* inter-record gap, inches */
+  double sim_start;	/* start/stop latency, seconds */
+  double sim_repos;	/* repositioning time after an underrun, seconds */
+  double sim_buffer;	/* drive buffer, bytes */
+  int sim_streaming;	/* NZ => tape is moving */
+  struct timespec sim_deadline;  /* when the tape reaches the next record */
+  struct timespec sim_done;	/* when the last op returned to the caller */
+  double sim_slack;	/* how long after that the next op may come */
+  unsigned long long sim_ops;	/* records and tape marks transferred */
+  unsigned long long sim_underruns;	/* times the consumer let the tape stop */
+  double sim_idle;	/* seconds spent stopping and repositioning */
+
+  /* read-ahead thread for local and simulated drives */
+  size_t ra_limit;	/* max bytes read ahead, 0 => no read-ahead */
+  struct readahead *ra;	/* running read-ahead, if any */
+};
+
+
+/* a record read ahead of the caller */
+struct ra_rec
+{
+  struct ra_rec *next;
+  int len;		/* record length, 0 = tape mark, -1 = read error */
+  char data [1];	/* actually len bytes */
+};
+
+/* read-ahead thread state */
+struct readahead
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;		/* queue or stop changed */
+  struct ra_rec *head, *tail;	/* records read but not yet consumed */
+  char *buf;			/* thread's record buffer */
+  size_t bytes;			/* data bytes in queue */
+  int stop;			/* NZ => thread should exit */
+  int eot;			/* NZ => thread read the double tape mark */
 };
 
 
@@ -103,6 +173,17 @@ struct mtape_t
 /* default tape density */
 #define BPI 1600
 
+/* environment variable giving read-ahead size in megabytes */
+#define READAHEAD_ENV "TAPEBUFFER"
+/* largest record the read-ahead thread can read */
+#define RA_MAX_REC TAPE_MAX_REC_LEN
+
+
+/* prefix selecting a simulated drive, and environment variable holding
+   its parameters as "name=value,..." */
+#define SIM_PREFIX "sim:"
+#define SIM_ENV "TAPESIM"
+
 
 /* magtape commands */
 static struct mtop mt_weof={ MTWEOF, 1 }; /* operation, count */
@@ -110,9 +191,87 @@ static struct mtop mt_rew={ MTREW, 1 };
 static struct mtop mt_fsr={ MTFSR, 1 };
 static struct mtop mt_fsf={ MTFSF, 1 };
 static struct mtop mt_bsr={ MTBSR, 1 };
-/* SCSI only: */
-static struct mtop mt_setblk={ MTSETBLK, 0 };  /* blockize = 0 (variable) */
-static struct mtop mt_setden={ MTSETDENSITY, 0x02 };  /* density = 1600 */
+
+
+/* drive profiles, set up on local/remote drives when opened (SCSI only) */
+struct drive_profile
+{
+  char *name;
+  int density;		/* density code, 0 = drive default, -1 = leave alone */
+  int blocksize;	/* 0 = variable length records */
+  int buffered;		/* buffered writes: 1 = on, 0 = off, -1 = leave alone */
+  int compression;	/* 1 = on, 0 = off, -1 = leave alone */
+  unsigned long bpi;	/* density for tape length accounting, 0 = unknown */
+};
+
+static struct drive_profile profiles [] =
+{
+  { "1600",          0x02, 0, -1, -1, 1600 },	/* 9-track emulation */
+  { "800",           0x01, 0, -1, -1,  800 },
+  { "6250",          0x03, 0, -1, -1, 6250 },
+  { "native",           0, 0,  1, -1,    0 },	/* whatever the drive does */
+  { "lto",              0, 0,  1,  0,    0 },	/* uncompressed archive */
+  { "lto-compress",     0, 0,  1,  1,    0 },
+  { NULL }
+};
+
+/* environment variable selecting profile, and the profile used otherwise */
+#define PROFILE_ENV "TAPEPROFILE"
+#define DEFAULT_PROFILE "1600"
+
+
+static void ra_stop (tape_handle_t mtape);
+
+/* exit status on errors */
+static int fail_status = 1;
+
+/* handle whose read-ahead thread this is, NULL in other threads */
+static __thread tape_handle_t ra_self;
+
+
+/* report a fatal read error; the read-ahead thread queues it for getrec
+   to report once the records before it are consumed, anyone else
+   prints it and exits */
+static void tape_error (char *fmt, ...)
+{
+  va_list ap;
+  char msg [256];
+  struct readahead *ra;
+  struct ra_rec *rec;
+  int n;
+
+  va_start (ap, fmt);
+  n = vsnprintf (msg, sizeof (msg), fmt, ap);
+  va_end (ap);
+  if (! ra_self)
+    {
+      fputs (msg, stderr);
+      exit (fail_status);
+    }
+
+  ra = ra_self->ra;
+  if (n >= sizeof (msg))
+    n = sizeof (msg) - 1;
+  if ((rec = malloc (sizeof (struct ra_rec) + n)) == NULL)
+    {
+      fputs (msg, stderr);
+      exit (fail_status);
+    }
+  rec->next = NULL;
+  rec->len = -1;
+  memcpy (rec->data, msg, n + 1);
+
+  pthread_mutex_lock (& ra->lock);
+  if (ra->tail)
+    ra->tail->next = rec;
+  else
+    ra->head = rec;
+  ra->tail = rec;
+  ra->eot = 1;
+  pthread_cond_broadcast (& ra->cond);
+  pthread_mutex_unlock (& ra->lock);
+  pthread_exit (NULL);
+}
 
 
 #define FAIL(msg) do { fprintf (stderr, msg); goto fail; } while (0)
@@ -124,7 +283,34 @@ static void dowrite (int handle, void *buf, int len)
   if (write (handle, buf, len) != len)
     {
       perror ("?Error on write");
-      exit (1);
+      exit (fail_status);
+    }
+}
+
+
+/* do a gathered write, finishing any partial write, punt on error */
+static void dowritev (int handle, struct iovec *iov, int iovcnt)
+{
+  ssize_t n;
+
+  while (iovcnt)
+    {
+      if ((n = writev (handle, iov, iovcnt)) < 0)
+	{
+	  perror ("?Error on write");
+	  exit (fail_status);
+	}
+      while (iovcnt && (n >= iov->iov_len))
+	{
+	  n -= iov->iov_len;
+	  iov++;
+	  iovcnt--;
+	}
+      if (iovcnt)
+	{
+	  iov->iov_base = (char *) iov->iov_base + n;
+	  iov->iov_len -= n;
+	}
     }
 }
 
@@ -136,15 +322,9 @@ static void doread (int handle, void *buf, int len)
   while(len)
     {
       if ((n = read (handle, buf, len)) < 0)
-	{
-	  perror("?Error on read");
-	  exit (1);
-	}
+	tape_error ("?Error on read: %s\n", strerror (errno));
       if (n == 0)
-	{
-	  fprintf (stderr, "?Unexpected end of file\n");
-	  exit (1);
-	}
+	tape_error ("?Unexpected end of file\n");
       buf += n;
       len -= n;
     }
@@ -161,7 +341,7 @@ static int response (tape_handle_t mtape)
   if (rc != 'A' && rc != 'E')
     {	/* must be Acknowledge or Error */
       fprintf (stderr, "?Invalid rmt response code:  %c\n",rc);
-      exit (1);
+      exit (fail_status);
     }
 
   /* get numeric value (returned by both A and E responses) */
@@ -177,7 +357,7 @@ static int response (tape_handle_t mtape)
     {		/* first non-digit char must be <LF> */
       fprintf (stderr, "?Invalid rmt response terminator:  %3.3o\n",
 	       ((int) c) & 0377);
-      exit (1);
+      exit (fail_status);
     }
   if (rc == 'A')
     return (n);	/* success, return value >=0 */
@@ -190,6 +370,109 @@ static int response (tape_handle_t mtape)
 }
 
 
+/* get the acknowledgement for the oldest outstanding rmt write */
+static void rmt_ack (tape_handle_t mtape)
+{
+  int n;
+
+  n = response (mtape);
+  if (n < 0)
+    {
+      perror ("?Error writing tape");
+      exit (fail_status);
+    }
+  if (n != mtape->wacklen [mtape->wackhead])
+    {
+      fprintf (stderr, "?Short write to remote tape (%d of %d bytes)\n",
+	       n, mtape->wacklen [mtape->wackhead]);
+      exit (fail_status);
+    }
+  mtape->wackhead = (mtape->wackhead + 1) % RMT_MAX_PENDING;
+  mtape->wackcount--;
+}
+
+
+/* send any corked rmt writes, then collect whatever acknowledgements
+   have already arrived without waiting for the rest */
+static void rmt_flush (tape_handle_t mtape)
+{
+  struct pollfd pfd;
+
+  if (mtape->wlen)
+    {
+      dowrite (mtape->tapefd, mtape->wbuf, mtape->wlen);
+      mtape->wlen = 0;
+    }
+
+  pfd.fd = mtape->tapefd;
+  pfd.events = POLLIN;
+  while (mtape->wackcount && (poll (& pfd, 1, 0) > 0))
+    rmt_ack (mtape);
+}
+
+
+/* send any corked rmt writes and wait for all of them to be acknowledged,
+   so that the next command's response isn't confused with a write's */
+static void rmt_sync (tape_handle_t mtape)
+{
+  rmt_flush (mtape);
+  while (mtape->wackcount)
+    rmt_ack (mtape);
+}
+
+
+/* queue a record for writing to an rmt server */
+static void rmt_write (tape_handle_t mtape, void *buf, int len)
+{
+  char hdr [16];
+  int n;
+
+  if (! mtape->wbuf)
+    {
+      mtape->wbuf = malloc (RMT_BATCH_BYTES);
+      if (! mtape->wbuf)
+	{
+	  fprintf (stderr, "?can't allocate rmt write buffer\n");
+	  exit (fail_status);
+	}
+    }
+
+  /* make room for one more acknowledgement */
+  if (mtape->wackcount == RMT_MAX_PENDING)
+    {
+      rmt_flush (mtape);
+      if (mtape->wackcount == RMT_MAX_PENDING)
+	rmt_ack (mtape);
+    }
+
+  n = sprintf (hdr, "W%d\n", len);
+  if (mtape->wlen + n + len > RMT_BATCH_BYTES)
+    rmt_flush (mtape);
+
+  if (n + len > RMT_BATCH_BYTES)
+    {		/* too big to cork, send command and data together */
+      struct iovec iov [2];
+      iov [0].iov_base = hdr;
+      iov [0].iov_len = n;
+      iov [1].iov_base = buf;
+      iov [1].iov_len = len;
+      dowritev (mtape->tapefd, iov, 2);
+    }
+  else
+    {
+      memcpy (mtape->wbuf + mtape->wlen, hdr, n);
+      memcpy (mtape->wbuf + mtape->wlen + n, buf, len);
+      mtape->wlen += n + len;
+    }
+
+  mtape->wacklen [(mtape->wackhead + mtape->wackcount) % RMT_MAX_PENDING] = len;
+  mtape->wackcount++;
+
+  if (mtape->wackcount == RMT_MAX_PENDING)
+    rmt_flush (mtape);
+}
+
+
 /* send ioctl() command to local or remote tape drive */
 static int doioctl (tape_handle_t mtape, struct mtop *op)
 {
@@ -199,6 +482,7 @@ static int doioctl (tape_handle_t mtape, struct mtop *op)
     return (ioctl (mtape->tapefd, MTIOCTOP, op));
   else
     {	/* "rmt" tape server */
+      rmt_sync (mtape);
       /* form cmd (better hope remote MT_OP values are the same) */
       len = sprintf (mtape->netbuf, "I%d\n%d\n", op->mt_op, op->mt_count);
       dowrite (mtape->tapefd, mtape->netbuf, len);
@@ -207,6 +491,198 @@ static int doioctl (tape_handle_t mtape, struct mtop *op)
 }
 
 
+/* set up the simulated drive model from the environment */
+static void sim_setup (tape_handle_t mtape)
+{
+  char *env, *opt, *val;
+  double d;
+
+  mtape->sim_ips = 125.0;
+  mtape->sim_gap = 0.6;
+  mtape->sim_start = 0.005;
+  mtape->sim_repos = 0.5;
+  mtape->sim_buffer = 0;
+
+  if ((env = getenv (SIM_ENV)) == NULL)
+    return;
+  if ((env = strdup (env)) == NULL)
+    {
+      fprintf (stderr, "?can't allocate simulator parameters\n");
+      exit (fail_status);
+    }
+  for (opt = strtok (env, ","); opt; opt = strtok (NULL, ","))
+    {
+      if ((val = index (opt, '=')) == NULL)
+	goto bad;
+      *val++ = '\0';
+      d = atof (val);
+      if (d < 0)
+	goto bad;
+      if (strcmp (opt, "bpi") == 0 && d > 0)
+	mtape->bpi = d;
+      else if (strcmp (opt, "ips") == 0 && d > 0)
+	mtape->sim_ips = d;
+      else if (strcmp (opt, "gap") == 0)
+	mtape->sim_gap = d;
+      else if (strcmp (opt, "start") == 0)
+	mtape->sim_start = d / 1000.0;
+      else if (strcmp (opt, "reposition") == 0)
+	mtape->sim_repos = d / 1000.0;
+      else if (strcmp (opt, "buffer") == 0)
+	mtape->sim_buffer = d;
+      else
+	goto bad;
+    }
+  free (env);
+  return;
+
+ bad:
+  fprintf (stderr, "?Bad %s parameter \"%s\"\n", SIM_ENV, opt);
+  exit (fail_status);
+}
+
+
+static double ts_seconds (struct timespec *ts)
+{
+  return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+
+static void ts_set (struct timespec *ts, double t)
+{
+  ts->tv_sec = (time_t) t;
+  ts->tv_nsec = (long) ((t - ts->tv_sec) * 1e9);
+}
+
+
+/* account for moving "inches" of tape past the head on the simulated
+   drive, sleeping until the drive would have finished */
+static void sim_transfer (tape_handle_t mtape, double inches)
+{
+  struct timespec now;
+  double t, start, ret, called;
+
+  clock_gettime (CLOCK_MONOTONIC, & now);
+  t = called = ts_seconds (& now);
+
+  /* the caller's time since the last operation is compared with the slack
+     it was given then, so that sleeping late isn't held against it */
+  if (! mtape->sim_streaming)
+    start = t + mtape->sim_start;	/* get the tape moving */
+  else if (t - ts_seconds (& mtape->sim_done) <= mtape->sim_slack)
+    {				/* kept up, tape still moving */
+      start = ts_seconds (& mtape->sim_deadline);
+      if (start < t)
+	start = t;
+    }
+  else
+    {
+      /* the buffer drained and the next record went by before it was
+	 asked for: the drive stopped, and must back up and get up to
+	 speed again */
+      mtape->sim_underruns++;
+      mtape->sim_idle += mtape->sim_repos + mtape->sim_start;
+      start = t + mtape->sim_repos + mtape->sim_start;
+    }
+
+  /* the caller gets control back once the tape is no more than a
+     buffer's worth behind it */
+  t = start + inches / mtape->sim_ips;
+  ret = t - mtape->sim_buffer / ((double) mtape->bpi * mtape->sim_ips);
+  if (ret < called)
+    ret = called;
+  ts_set (& now, ret);
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, & now, NULL) == EINTR)
+    ;
+
+  /* the drive will keep moving until it crosses the next gap */
+  ts_set (& mtape->sim_deadline, t + mtape->sim_gap / mtape->sim_ips);
+  mtape->sim_slack = ts_seconds (& mtape->sim_deadline) - ret;
+  clock_gettime (CLOCK_MONOTONIC, & mtape->sim_done);
+  mtape->sim_streaming = 1;
+  mtape->sim_ops++;
+}
+
+
+/* set up a local or remote drive according to a profile, given as a
+   profile name optionally followed by ",name=value" overrides */
+int tapeprofile (tape_handle_t mtape, char *spec)
+{
+  struct drive_profile prof;
+  struct mtop op;
+  char *str, *opt, *val;
+  int i;
+
+  if ((mtape->tape_type != TT_TAPE) && (mtape->tape_type != TT_RMT))
+    return (0);
+
+  if ((str = strdup (spec)) == NULL)
+    return (-1);
+  opt = strtok (str, ",");
+  for (i = 0; profiles [i].name; i++)
+    if (opt && strcmp (opt, profiles [i].name) == 0)
+      break;
+  if (! profiles [i].name)
+    goto bad;
+  prof = profiles [i];
+
+  while ((opt = strtok (NULL, ",")) != NULL)
+    {
+      if ((val = index (opt, '=')) == NULL)
+	goto bad;
+      *val++ = '\0';
+      if (strcmp (opt, "density") == 0)
+	prof.density = strtol (val, NULL, 0);
+      else if (strcmp (opt, "block") == 0)
+	prof.blocksize = strtol (val, NULL, 0);
+      else if (strcmp (opt, "buffer") == 0)
+	prof.buffered = strtol (val, NULL, 0);
+      else if (strcmp (opt, "compress") == 0)
+	prof.compression = strtol (val, NULL, 0);
+      else if (strcmp (opt, "bpi") == 0)
+	prof.bpi = strtoul (val, NULL, 0);
+      else
+	goto bad;
+    }
+  free (str);
+
+  /* (ignore errors in case not SCSI) */
+  op.mt_op = MTSETBLK;
+  op.mt_count = prof.blocksize;
+  doioctl (mtape, & op);
+  if (prof.density >= 0)
+    {
+      op.mt_op = MTSETDENSITY;
+      op.mt_count = prof.density;
+      doioctl (mtape, & op);
+    }
+#if defined(MTSETDRVBUFFER) && defined(MT_ST_SETBOOLEANS)
+  if (prof.buffered >= 0)
+    {
+      op.mt_op = MTSETDRVBUFFER;
+      op.mt_count = (prof.buffered ? MT_ST_SETBOOLEANS : MT_ST_CLEARBOOLEANS) |
+	MT_ST_BUFFER_WRITES;
+      doioctl (mtape, & op);
+    }
+#endif
+#ifdef MTCOMPRESSION
+  if (prof.compression >= 0)
+    {
+      op.mt_op = MTCOMPRESSION;
+      op.mt_count = prof.compression;
+      doioctl (mtape, & op);
+    }
+#endif
+
+  mtape->bpi = prof.bpi;
+  return (0);
+
+ bad:
+  free (str);
+  return (-1);
+}
+
+
 /* open the tape drive (or whatever) */
 /* "create" =1 to create if file, "writable" =1 to open with write access */
 tape_handle_t opentape (char *name, int create, int writable)
@@ -214,6 +690,7 @@ tape_handle_t opentape (char *name, int create, int writable)
   char *p, *user, *port;
   int len;
   char *host = NULL;
+  int sim = 0;
 
   tape_handle_t mtape = NULL;
 
@@ -232,12 +709,19 @@ tape_handle_t opentape (char *name, int create, int writable)
   if (name == NULL)
     name = TAPE;		/* or use our default */
 
+  /* image file behind a simulated drive if it has the prefix */
+  if (strncmp (name, SIM_PREFIX, strlen (SIM_PREFIX)) == 0)
+    {
+      name += strlen (SIM_PREFIX);
+      sim = 1;
+    }
+
   /* just a file if no colon in filename */
-  if ((p = index (name, ':')) == NULL)
+  if (sim || (p = index (name, ':')) == NULL)
     {
       /* there's probably a better way to handle this, in case a file is really
 	 a link to a tape drive -- handler index or something? */
-      if (strncmp (name, "/dev/", 5) == 0) 
+      if ((! sim) && (strncmp (name, "/dev/", 5) == 0))
 	{
 	  /* assume tape if starts with /dev/ */
 	  mtape->tape_type = TT_TAPE;
@@ -256,8 +740,11 @@ tape_handle_t opentape (char *name, int create, int writable)
 	  else
 	    {
 	      if (create)
-		mtape->tapefd = open (name, O_CREAT | O_TRUNC |
-				      O_WRONLY | O_BINARY, 0644);
+		{
+		  mtape->tapefd = open (name, O_CREAT | O_TRUNC |
+					O_WRONLY | O_BINARY, 0644);
+		  mtape->seek_ok = 1;
+		}
 	      else
 		{
 		  mtape->tapefd = open (name, (writable ? O_RDWR : O_RDONLY) |
@@ -268,6 +755,11 @@ tape_handle_t opentape (char *name, int create, int writable)
 	}
       if (mtape->tapefd < 0)
 	FAIL ("?can't open device or file\n");
+      if (sim)
+	{
+	  mtape->tape_type = TT_SIM;
+	  sim_setup (mtape);
+	}
     }
   else
     {	/* "rmt" tape server on remote host */
@@ -312,13 +804,16 @@ tape_handle_t opentape (char *name, int create, int writable)
   if ((mtape->tape_type == TT_TAPE) ||
       (mtape->tape_type == TT_RMT))
     {
-      /* (ignore errors in case not SCSI) */
-      /* set variable record length mode */
-      doioctl (mtape, & mt_setblk);
-      /* set density to 1600 */
-      doioctl (mtape, & mt_setden);
+      if ((p = getenv (PROFILE_ENV)) == NULL)
+	p = DEFAULT_PROFILE;
+      if (tapeprofile (mtape, p) < 0)
+	FAIL ("?Bad drive profile\n");
     }
 
+  /* read ahead from drives if asked to */
+  if ((! writable) && (p = getenv (READAHEAD_ENV)) != NULL)
+    tapereadahead (mtape, (size_t) (atof (p) * 1048576));
+
   if (host)
     free (host);
 
@@ -338,6 +833,7 @@ tape_handle_t opentape (char *name, int create, int writable)
 /* close the tape drive */
 void closetape (tape_handle_t mtape)
 {
+  ra_stop (mtape);
   if (mtape->waccess) 
     {				/* opened for create/append */
       tapemark (mtape);		/* add one more tape mark */
@@ -345,18 +841,25 @@ void closetape (tape_handle_t mtape)
     }
   if (mtape->tape_type == TT_RMT) 
     {
+      rmt_sync (mtape);
       dowrite (mtape->tapefd, "C\n", 2);
       if (response (mtape) < 0)
 	{
 	  perror("?Error closing remote tape");
-	  exit(1);
+	  exit (fail_status);
 	}
     }
   if (close (mtape->tapefd) < 0)
     {
       perror("?Error closing tape");
-      exit(1);
+      exit (fail_status);
     }
+  if (mtape->tape_type == TT_SIM)
+    fprintf (stderr, "tape simulator: %llu records, %llu underruns, "
+	     "%.3f seconds stopped or repositioning\n",
+	     mtape->sim_ops, mtape->sim_underruns, mtape->sim_idle);
+  if (mtape->wbuf)
+    free (mtape->wbuf);
   free (mtape);
 }
 
@@ -364,20 +867,22 @@ void closetape (tape_handle_t mtape)
 /* rewind tape */
 void posnbot (tape_handle_t mtape)
 {
-  if (mtape->tape_type == TT_IMAGE)
+  ra_stop (mtape);
+  if (IS_IMAGE (mtape))
     {		/* image file */
       if (lseek (mtape->tapefd, 0L, SEEK_SET) < 0) 
 	{
 	  perror("?Seek failed");
-	  exit(1);
+	  exit (fail_status);
 	}
+      mtape->sim_streaming = 0;	/* simulated drive stops to reposition */
     }
   else
     {				/* local/remote tape drive */
       if (doioctl (mtape, & mt_rew) < 0)
 	{
 	  perror("?Rewind failed");
-	  exit(1);
+	  exit (fail_status);
 	}
     }
 }
@@ -386,13 +891,15 @@ void posnbot (tape_handle_t mtape)
 /* position tape at EOT (between the two tape marks) */
 void posneot (tape_handle_t mtape)
 {
-  if (mtape->tape_type == TT_IMAGE)
+  ra_stop (mtape);
+  if (IS_IMAGE (mtape))
     {		/* image file */
       if (lseek (mtape->tapefd, -4L, SEEK_END) < 0) 
 	{
 	  perror("?Seek failed");
-	  exit(1);
+	  exit (fail_status);
 	}
+      mtape->sim_streaming = 0;	/* simulated drive stops to reposition */
     }
   else 
     {				/* local/remote tape drive */
@@ -403,7 +910,7 @@ void posneot (tape_handle_t mtape)
 	  if (doioctl (mtape, & mt_fsf) < 0)
 	    {
 	      perror("?Error spacing to EOT");
-	      exit(1);
+	      exit (fail_status);
 	    }
 	  /* space one record more to see if double EOF */
 	  if (doioctl (mtape, & mt_fsr) < 0)
@@ -416,21 +923,21 @@ void posneot (tape_handle_t mtape)
       if (doioctl (mtape, & mt_bsr) < 0)
 	{  /* get between them */
 	  perror("?Error backspacing at EOT");
-	  exit(1);
+	  exit (fail_status);
 	}
 #endif
     }
 }
 
 
-/* read a tape record, return actual length (0=tape mark) */
-int getrec (tape_handle_t mtape, void *buf, int len)
+/* read a tape record from the drive or image itself */
+static int getrec_direct (tape_handle_t mtape, void *buf, int len)
 {
   unsigned char byte [4];		/* 32 bits for length field(s) */
   unsigned long l;		/* at least 32 bits */
   int i;
   
-  if (mtape->tape_type == TT_IMAGE)
+  if (IS_IMAGE (mtape))
     {		/* image file */
       doread (mtape->tapefd, byte, 4);	/* get record length */
       l=((unsigned long)byte[3]<<24L)|((unsigned long)byte[2]<<16L)|
@@ -450,19 +957,19 @@ int getrec (tape_handle_t mtape, void *buf, int len)
 	      ((unsigned long)byte[1]<<8)|
 	      (unsigned long)byte[0])!=l)
 	    {	/* should match */
-	      fprintf (stderr,"?Corrupt tape image\n");
-	      exit(1);
+	      tape_error ("?Corrupt tape image\n");
 	    }
 	}
     }
   else if (mtape->tape_type == TT_RMT)
     {		/* rmt tape server */
+      rmt_sync (mtape);
       len = sprintf (mtape->netbuf, "R%d\n", len);
       dowrite (mtape->tapefd, mtape->netbuf, len);
       if ((i = response (mtape)) < 0)
 	{
 	  perror("?Error reading tape");
-	  exit(1);
+	  exit (fail_status);
 	}
       l = i;
       if (l)
@@ -471,18 +978,340 @@ int getrec (tape_handle_t mtape, void *buf, int len)
   else 
     {				/* local tape drive */
       if ((i = read (mtape->tapefd, buf, len)) < 0)
-	{
-	  perror("?Error reading tape");
-	  exit(1);
-	}
+	tape_error ("?Error reading tape: %s\n", strerror (errno));
       l = i;
     }
+  if (mtape->tape_type == TT_SIM)
+    sim_transfer (mtape, l ? (double) l / mtape->bpi : 3.0);
   return(l);
 
  toolong:
-  fprintf(stderr,"?%ld byte tape record too long for %d byte buffer\n",
-	  l,len);
-  exit(1);
+  tape_error ("?%ld byte tape record too long for %d byte buffer\n", l, len);
+  return (-1);
+}
+
+
+/* read-ahead thread: keep reading records until the queue holds ra_limit
+   bytes, the end of tape is reached, or we're told to stop */
+static void *ra_thread (void *arg)
+{
+  tape_handle_t mtape = (tape_handle_t) arg;
+  struct readahead *ra = mtape->ra;
+  struct ra_rec *rec;
+  char *buf;
+  int len, stop;
+  int prevlen = -1;
+
+  ra_self = mtape;
+  buf = ra->buf;
+
+  for (;;)
+    {
+      pthread_mutex_lock (& ra->lock);
+      while (! ra->stop && ra->bytes >= mtape->ra_limit)
+	pthread_cond_wait (& ra->cond, & ra->lock);
+      stop = ra->stop;
+      pthread_mutex_unlock (& ra->lock);
+      if (stop)
+	break;
+
+      len = getrec_direct (mtape, buf, RA_MAX_REC);
+      if ((rec = malloc (sizeof (struct ra_rec) + len)) == NULL)
+	{
+	  fprintf (stderr, "?can't allocate read-ahead record\n");
+	  exit (fail_status);
+	}
+      rec->next = NULL;
+      rec->len = len;
+      memcpy (rec->data, buf, len);
+
+      pthread_mutex_lock (& ra->lock);
+      if (ra->tail)
+	ra->tail->next = rec;
+      else
+	ra->head = rec;
+      ra->tail = rec;
+      ra->bytes += len;
+      if (len == 0 && prevlen == 0)
+	ra->eot = 1;
+      stop = ra->eot;
+      pthread_cond_broadcast (& ra->cond);
+      pthread_mutex_unlock (& ra->lock);
+      if (stop)
+	break;
+      prevlen = len;
+    }
+
+  return (NULL);
+}
+
+
+/* start reading ahead */
+static void ra_start (tape_handle_t mtape)
+{
+  struct readahead *ra;
+
+  if ((ra = calloc (1, sizeof (struct readahead))) == NULL)
+    {
+      fprintf (stderr, "?can't allocate read-ahead state\n");
+      exit (fail_status);
+    }
+  if ((ra->buf = malloc (RA_MAX_REC)) == NULL)
+    {
+      fprintf (stderr, "?can't allocate read-ahead buffer\n");
+      exit (fail_status);
+    }
+  pthread_mutex_init (& ra->lock, NULL);
+  pthread_cond_init (& ra->cond, NULL);
+  mtape->ra = ra;
+  if (pthread_create (& ra->thread, NULL, ra_thread, mtape) != 0)
+    {
+      fprintf (stderr, "?can't start read-ahead thread\n");
+      exit (fail_status);
+    }
+}
+
+
+/* stop reading ahead and discard anything not yet consumed; the drive is
+   left somewhere past the caller's position, so only use this before
+   repositioning or closing */
+static void ra_stop (tape_handle_t mtape)
+{
+  struct readahead *ra = mtape->ra;
+  struct ra_rec *rec;
+
+  if (! ra)
+    return;
+  pthread_mutex_lock (& ra->lock);
+  ra->stop = 1;
+  pthread_cond_broadcast (& ra->cond);
+  pthread_mutex_unlock (& ra->lock);
+  pthread_join (ra->thread, NULL);
+
+  while ((rec = ra->head) != NULL)
+    {
+      ra->head = rec->next;
+      free (rec);
+    }
+  pthread_cond_destroy (& ra->cond);
+  pthread_mutex_destroy (& ra->lock);
+  free (ra->buf);
+  free (ra);
+  mtape->ra = NULL;
+}
+
+
+/* read a tape record, return actual length (0=tape mark) */
+int getrec (tape_handle_t mtape, void *buf, int len)
+{
+  struct readahead *ra;
+  struct ra_rec *rec;
+  int l;
+
+  if (mtape->ra_limit && ! mtape->ra)
+    ra_start (mtape);
+  ra = mtape->ra;
+  if (! ra)
+    return (getrec_direct (mtape, buf, len));
+
+  pthread_mutex_lock (& ra->lock);
+  while (! ra->head && ! ra->eot)
+    pthread_cond_wait (& ra->cond, & ra->lock);
+  rec = ra->head;
+  if (rec)
+    {
+      ra->head = rec->next;
+      if (! ra->head)
+	ra->tail = NULL;
+      if (rec->len > 0)
+	ra->bytes -= rec->len;
+      pthread_cond_broadcast (& ra->cond);
+    }
+  pthread_mutex_unlock (& ra->lock);
+
+  if (! rec)
+    {
+      /* consumed everything up to the end of tape, and the thread has
+	 finished, so anything further is read directly */
+      return (getrec_direct (mtape, buf, len));
+    }
+
+  l = rec->len;
+  if (l < 0)
+    {			/* the thread hit an error reading this record */
+      fputs (rec->data, stderr);
+      exit (fail_status);
+    }
+  if (l > len)
+    {
+      fprintf (stderr, "?%d byte tape record too long for %d byte buffer\n",
+	       l, len);
+      exit (fail_status);
+    }
+  memcpy (buf, rec->data, l);
+  free (rec);
+  return (l);
+}
+
+
+/* set the read-ahead size, 0 to turn read-ahead off */
+void tapereadahead (tape_handle_t mtape, size_t bytes)
+{
+  if (mtape->tape_type != TT_TAPE && mtape->tape_type != TT_SIM)
+    return;
+  ra_stop (mtape);
+  mtape->ra_limit = bytes;
+}
+
+
+/* read only the framing of the next record, leaving its data unread if
+   the image can seek; return its length (0=tape mark), and the file offset
+   of its data if "dataoff" isn't NULL (-1 if the data had to be read) */
+/* read a length word of a seekable image; return NZ with errno set, or 0
+   for end of file, if it isn't all there */
+static int image_word (int fd, unsigned long *l)
+{
+  unsigned char byte [4];
+  int n, got;
+
+  for (got = 0; got < 4; got += n)
+    if ((n = read (fd, byte + got, 4 - got)) <= 0)
+      {
+	if (n == 0)
+	  errno = 0;
+	return (-1);
+      }
+  *l=((unsigned long)byte[3]<<24L)|((unsigned long)byte[2]<<16L)|
+    ((unsigned long)byte[1]<<8L)|(unsigned long)byte[0];
+  return (0);
+}
+
+
+/* getreclen() on a seekable image: -1 with errno set (0 at end of file)
+   if the record isn't all there, -2 if its length words don't match */
+static int image_reclen (tape_handle_t mtape, off_t *dataoff)
+{
+  unsigned long l, trailer;
+  off_t pos, end;
+  struct stat st;
+  int pad;
+
+  if (dataoff)
+    *dataoff = -1;
+  if (image_word (mtape->tapefd, & l))
+    return (-1);
+  if (l == 0)
+    return (0);
+
+  pad = (l & 1) != 0 && (mtape->flags & TF_SIMH) != 0;
+  if ((pos = lseek (mtape->tapefd, 0, SEEK_CUR)) < 0 ||
+      fstat (mtape->tapefd, & st) < 0)
+    return (-1);
+  end = pos + l + pad;
+  if (S_ISREG (st.st_mode) && end > st.st_size)
+    {			/* the data would be a hole past the end */
+      errno = 0;
+      return (-1);
+    }
+  if (lseek (mtape->tapefd, end, SEEK_SET) < 0)
+    return (-1);
+  if (dataoff)
+    *dataoff = pos;
+
+  if (image_word (mtape->tapefd, & trailer))
+    return (-1);
+  if (trailer != l)
+    return (-2);	/* should match */
+  return (l);
+}
+
+
+int getreclen (tape_handle_t mtape, off_t *dataoff)
+{
+  static char scratch_buf [RA_MAX_REC];
+  int l;
+
+  if (mtape->tape_type != TT_IMAGE || ! mtape->seek_ok)
+    {
+      if (dataoff)
+	*dataoff = -1;
+      return (getrec (mtape, scratch_buf, sizeof (scratch_buf)));
+    }
+
+  if ((l = image_reclen (mtape, dataoff)) == -2)
+    tape_error ("?Corrupt tape image\n");
+  else if (l < 0 && errno)
+    tape_error ("?Error on read: %s\n", strerror (errno));
+  else if (l < 0)
+    tape_error ("?Unexpected end of file\n");
+  return (l);
+}
+
+
+int tapeimagereclen (tape_handle_t mtape)
+{
+  int l;
+
+  if (mtape->tape_type != TT_IMAGE || ! mtape->seek_ok)
+    return (-1);
+  l = image_reclen (mtape, NULL);
+  return ((l < 0) ? -1 : l);
+}
+
+
+/* file descriptor of an image file that supports seeking, -1 otherwise;
+   "-" never counts, even if it is redirected from a regular file */
+int tapeimagefd (tape_handle_t mtape)
+{
+  struct stat st;
+
+  if (mtape->tape_type != TT_IMAGE || ! mtape->seek_ok)
+    return (-1);
+  if (fstat (mtape->tapefd, & st) < 0 || ! S_ISREG (st.st_mode))
+    return (-1);
+  return (mtape->tapefd);
+}
+
+
+/* copy "len" bytes of an image file from offset "off" to the current
+   position of "outfd", in the kernel when it can do that; returns the
+   number of bytes copied, short only at the end of the image, or -1 on an
+   error */
+off_t tapeimagecopy (int infd, off_t off, int outfd, off_t len)
+{
+  char buf [65536];
+  off_t done = 0;
+  ssize_t n;
+  size_t count;
+
+  while (done < len)
+    {
+#ifdef __linux__
+      n = copy_file_range (infd, & off, outfd, NULL, len - done, 0);
+      if (n > 0)
+	{
+	  done += n;
+	  continue;
+	}
+      if (n == 0)
+	break;
+      if (errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+	  errno != EOPNOTSUPP)
+	return (-1);
+#endif
+      /* no kernel copy between these files, do it here */
+      count = (len - done > sizeof (buf)) ? sizeof (buf) : len - done;
+      n = pread (infd, buf, count, off);
+      if (n < 0)
+	return (-1);
+      if (n == 0)
+	break;
+      if (write (outfd, buf, n) != n)
+	return (-1);
+      off += n;
+      done += n;
+    }
+  return (done);
 }
 
 
@@ -490,27 +1319,30 @@ int getrec (tape_handle_t mtape, void *buf, int len)
 void putrec (tape_handle_t mtape, void *buf, int len)
 {
   unsigned char l [4];
+  struct iovec iov [3];
 
-  if (mtape->tape_type == TT_IMAGE)
+  if (IS_IMAGE (mtape))
     {		/* image file */
       l [0] = len & 0377;		/* PDP-11 byte order */
       l [1] = (len >> 8) &0377;
-      l [2] = 0;			/* our recs are always < 64 KB */
-      l [3] = 0;
-      dowrite (mtape->tapefd, l, 4);	/* write longword length */
-      dowrite (mtape->tapefd, buf, len);  /* write data */
-      dowrite (mtape->tapefd, l, 4);	/* write length again */
+      l [2] = (len >> 16) & 0377;	/* reblocked recs can be >= 64 KB */
+      l [3] = (len >> 24) & 0377;
+      iov [0].iov_base = l;		/* longword length */
+      iov [0].iov_len = 4;
+      iov [1].iov_base = buf;		/* data */
+      iov [1].iov_len = len;
+      iov [2].iov_base = l;		/* length again */
+      iov [2].iov_len = 4;
+      dowritev (mtape->tapefd, iov, 3);	/* all in one system call */
     }
   else if (mtape->tape_type == TT_RMT)
-    {		/* rmt tape */
-      int n;
-      n = sprintf (mtape->netbuf, "W%d\n", len);
-      dowrite (mtape->tapefd, mtape->netbuf, n);
-      dowrite (mtape->tapefd, buf, len);
-    }
+    rmt_write (mtape, buf, len);	/* rmt tape, acknowledged later */
   else
     dowrite (mtape->tapefd, buf, len);	/* just write the data if tape */
 
+  if (mtape->tape_type == TT_SIM)
+    sim_transfer (mtape, (double) len / mtape->bpi);
+
   mtape->count += len + (mtape->bpi * 3 /5);  /* add to byte count
 						 (+0.6" tape gap) */
 }
@@ -521,7 +1353,7 @@ void tapemark (tape_handle_t mtape)
 {
   static char zero [4] = { 0, 0, 0, 0 };
 
-  if (mtape->tape_type == TT_IMAGE)
+  if (IS_IMAGE (mtape))
     {		/* image file */
       dowrite (mtape->tapefd, zero, 4);	/* write longword length */
     }
@@ -530,29 +1362,54 @@ void tapemark (tape_handle_t mtape)
       if (doioctl (mtape, & mt_weof) < 0) 
 	{
 	  perror ("?Failed writing tape mark");
-	  exit (1);
+	  exit (fail_status);
 	}
     }
+  if (mtape->tape_type == TT_SIM)
+    sim_transfer (mtape, 3.0);
   mtape->count += 3 * mtape->bpi;	/* 3" of tape */
 }
 
 
+/* skip one record that may have been read ahead, return its length */
+static int ra_skip (tape_handle_t mtape)
+{
+  static char scratch_buf [RA_MAX_REC];
+
+  return (getrec (mtape, scratch_buf, sizeof (scratch_buf)));
+}
+
+
 /* skip records (negative for reverse) */
 void skiprec (tape_handle_t mtape, int count)
 {
   unsigned char byte [4];		/* 32 bits for length field(s) */
   unsigned long l;		/* at least 32 bits */
   
-  if (mtape->tape_type != TT_IMAGE)
-    {
-      fprintf (stderr, "?Record skip only implemented for image files");
-      exit (1);
+  if (mtape->ra && count >= 0)
+    {			/* drive is already past them, consume read-ahead */
+      while (count-- && ra_skip (mtape))
+	;
+      return;
     }
 
   if (count < 0)
     {
       fprintf (stderr, "?Record skip reverse not yet implemented");
-      exit (1);
+      exit (fail_status);
+    }
+
+  if (! IS_IMAGE (mtape))
+    {				/* local/remote tape drive */
+      struct mtop op;
+      op.mt_op = MTFSR;
+      op.mt_count = count;
+      if (count && doioctl (mtape, & op) < 0)
+	{
+	  perror ("?Record skip failed");
+	  exit (fail_status);
+	}
+      return;
     }
 
   while (count--)
@@ -570,7 +1427,7 @@ void skiprec (tape_handle_t mtape, int count)
       if (lseek (mtape->tapefd, l, SEEK_CUR) < 0)
 	{
 	  perror ("?Seek failed");
-	  exit (1);
+	  exit (fail_status);
 	}
 
       doread (mtape->tapefd, byte, 4);  /* get trailing record length */
@@ -580,7 +1437,7 @@ void skiprec (tape_handle_t mtape, int count)
 	  (unsigned long)byte[0])!=l)
 	{	/* should match */
 	  fprintf (stderr,"?Corrupt tape image\n");
-	  exit(1);
+	  exit (fail_status);
 	}
     }
 }
@@ -595,10 +1452,10 @@ static void skip_to_mark (tape_handle_t mtape)
 
   static char scratch_buf [4096];
 
-  if (mtape->tape_type != TT_IMAGE)
+  if (! IS_IMAGE (mtape))
     {
       fprintf (stderr, "?Record skip only implemented for image files");
-      exit (1);
+      exit (fail_status);
     }
 
   for (;;)
@@ -618,7 +1475,7 @@ static void skip_to_mark (tape_handle_t mtape)
 	  if (lseek (mtape->tapefd, l, SEEK_CUR) < 0)
 	    {
 	      perror ("?Seek failed");
-	      exit (1);
+	      exit (fail_status);
 	    }
 	}
       else
@@ -642,7 +1499,7 @@ static void skip_to_mark (tape_handle_t mtape)
 	  (unsigned long)byte[0])!=l)
 	{	/* should match */
 	  fprintf (stderr,"?Corrupt tape image\n");
-	  exit(1);
+	  exit (fail_status);
 	}
     }
 }
@@ -651,22 +1508,38 @@ static void skip_to_mark (tape_handle_t mtape)
 /* skip files (negative for reverse) */
 void skipfile (tape_handle_t mtape, int count)
 {
-  if (mtape->tape_type != TT_IMAGE)
-    {
-      fprintf (stderr, "?File skip only implemented for image files");
-      exit (1);
+  if (mtape->ra && count >= 0)
+    {			/* drive is already past them, consume read-ahead */
+      while (count--)
+	while (ra_skip (mtape))
+	  ;
+      return;
     }
 
   if (count < 0)
     {
       fprintf (stderr, "?File skip reverse not yet implemented");
-      exit (1);
+      exit (fail_status);
+    }
+
+  if (! IS_IMAGE (mtape))
+    {				/* local/remote tape drive */
+      struct mtop op;
+      op.mt_op = MTFSF;
+      op.mt_count = count;
+      if (count && doioctl (mtape, & op) < 0)
+	{
+	  perror ("?File skip failed");
+	  exit (fail_status);
+	}
+      return;
     }
 
   while (count--)
     {
       skip_to_mark (mtape);
     }
+  mtape->sim_streaming = 0;
 }
 
 /* set tape flags */
@@ -674,3 +1547,255 @@ void tapeflags (tape_handle_t mtape, int flags)
 {
   mtape->flags = flags;
 }
+
+
+void tapefailstatus (int status)
+{
+  fail_status = status;
+}
+
+
+#ifdef USE_EPOLL
+/* state of one rmt handle within tapeloop() */
+struct loop_rmt
+{
+  int active;		/* NZ => waiting for the response to an R command */
+  int oflags;		/* file status flags to restore afterwards */
+  int state;		/* one of the LS_* values below */
+  int code;		/* response code, 'A' or 'E' */
+  int value;		/* numeric value of response */
+  int have;		/* data bytes received so far */
+};
+
+#define LS_CODE  0	/* expecting response code */
+#define LS_VALUE 1	/* collecting digits of response value */
+#define LS_ERROR 2	/* skipping error message text */
+#define LS_DATA  3	/* receiving record data */
+
+
+/* send an R command for the next record on an rmt handle in tapeloop() */
+static void loop_request (tape_handle_t mtape, struct loop_rmt *lr, int len)
+{
+  int n;
+
+  n = sprintf (mtape->netbuf, "R%d\n", len);
+  dowrite (mtape->tapefd, mtape->netbuf, n);
+  lr->state = LS_CODE;
+  lr->value = 0;
+  lr->have = 0;
+}
+
+
+/* consume whatever response bytes have arrived for an rmt handle, return
+   record length once one is complete, or -1 if more is needed */
+static int loop_receive (tape_handle_t mtape, struct loop_rmt *lr,
+			 char *buf, int len)
+{
+  char c;
+  int n;
+
+  for (;;)
+    {
+      if (lr->state == LS_DATA)
+	{
+	  if (lr->have == lr->value)
+	    return (lr->value);
+	  n = read (mtape->tapefd, buf + lr->have, lr->value - lr->have);
+	}
+      else
+	n = read (mtape->tapefd, &c, 1);
+
+      if (n < 0)
+	{
+	  if (errno == EAGAIN || errno == EWOULDBLOCK)
+	    return (-1);
+	  perror ("?Error on read");
+	  exit (fail_status);
+	}
+      if (n == 0)
+	{
+	  fprintf (stderr, "?Unexpected end of file\n");
+	  exit (fail_status);
+	}
+
+      switch (lr->state)
+	{
+	case LS_CODE:
+	  if (c != 'A' && c != 'E')
+	    {
+	      fprintf (stderr, "?Invalid rmt response code:  %c\n", c);
+	      exit (fail_status);
+	    }
+	  lr->code = c;
+	  lr->state = LS_VALUE;
+	  break;
+	case LS_VALUE:
+	  if (c >= '0' && c <= '9')
+	    {
+	      lr->value = lr->value * 10 + (c - '0');
+	      break;
+	    }
+	  if (c != '\n')
+	    {
+	      fprintf (stderr, "?Invalid rmt response terminator:  %3.3o\n",
+		       ((int) c) & 0377);
+	      exit (fail_status);
+	    }
+	  if (lr->code == 'E')
+	    lr->state = LS_ERROR;
+	  else if (lr->value > len)
+	    {
+	      fprintf (stderr, "?%d byte tape record too long for %d byte buffer\n",
+		       lr->value, len);
+	      exit (fail_status);
+	    }
+	  else
+	    lr->state = LS_DATA;
+	  break;
+	case LS_ERROR:
+	  if (c == '\n')
+	    {
+	      errno = lr->value;
+	      perror ("?Error reading tape");
+	      exit (fail_status);
+	    }
+	  break;
+	case LS_DATA:
+	  lr->have += n;
+	  break;
+	}
+    }
+}
+#endif /* USE_EPOLL */
+
+
+/* read several tapes from one thread, passing each record to fn() */
+void tapeloop (tape_handle_t *h, int count, int len, tape_record_fn fn,
+	       void *arg)
+{
+  char **bufs;
+  char *done;
+  int active = 0;
+  int i, l;
+#ifdef USE_EPOLL
+  struct loop_rmt *lr;
+  struct epoll_event ev, *events;
+  int epfd, polled = 0, unpolled;
+  int n, j;
+#endif
+
+  bufs = calloc (count, sizeof (char *));
+  done = calloc (count, 1);
+  if (! bufs || ! done)
+    {
+      fprintf (stderr, "?can't allocate tape loop state\n");
+      exit (fail_status);
+    }
+  for (i = 0; i < count; i++)
+    {
+      if (! (bufs [i] = malloc (len)))
+	{
+	  fprintf (stderr, "?can't allocate tape loop buffer\n");
+	  exit (fail_status);
+	}
+      active++;
+    }
+
+#ifdef USE_EPOLL
+  lr = calloc (count, sizeof (struct loop_rmt));
+  events = calloc (count, sizeof (struct epoll_event));
+  if (! lr || ! events)
+    {
+      fprintf (stderr, "?can't allocate tape loop state\n");
+      exit (fail_status);
+    }
+  if ((epfd = epoll_create1 (0)) < 0)
+    {
+      perror ("?Can't create epoll instance");
+      exit (fail_status);
+    }
+
+  /* rmt handles are serviced as their data arrives, with one R command
+     outstanding on each; everything else is read synchronously in turn */
+  for (i = 0; i < count; i++)
+    {
+      if (h [i]->tape_type != TT_RMT)
+	continue;
+      rmt_sync (h [i]);
+      lr [i].oflags = fcntl (h [i]->tapefd, F_GETFL);
+      fcntl (h [i]->tapefd, F_SETFL, lr [i].oflags | O_NONBLOCK);
+      ev.events = EPOLLIN;
+      ev.data.u32 = i;
+      if (epoll_ctl (epfd, EPOLL_CTL_ADD, h [i]->tapefd, & ev) < 0)
+	{
+	  perror ("?Can't add tape to epoll instance");
+	  exit (fail_status);
+	}
+      lr [i].active = 1;
+      polled++;
+      loop_request (h [i], & lr [i], len);
+    }
+#endif
+
+  while (active)
+    {
+#ifdef USE_EPOLL
+      unpolled = active - polled;
+      if (polled)
+	{
+	  n = epoll_wait (epfd, events, count, unpolled ? 0 : -1);
+	  if (n < 0 && errno != EINTR)
+	    {
+	      perror ("?Error waiting for tapes");
+	      exit (fail_status);
+	    }
+	  for (j = 0; j < n; j++)
+	    {
+	      i = events [j].data.u32;
+	      while (lr [i].active &&
+		     (l = loop_receive (h [i], & lr [i], bufs [i], len)) >= 0)
+		{
+		  if (fn (i, bufs [i], l, arg))
+		    {
+		      epoll_ctl (epfd, EPOLL_CTL_DEL, h [i]->tapefd, NULL);
+		      fcntl (h [i]->tapefd, F_SETFL, lr [i].oflags);
+		      lr [i].active = 0;
+		      done [i] = 1;
+		      polled--;
+		      active--;
+		    }
+		  else
+		    loop_request (h [i], & lr [i], len);
+		}
+	    }
+	}
+      if (! unpolled)
+	continue;
+#endif
+      for (i = 0; i < count; i++)
+	{
+	  if (done [i])
+	    continue;
+#ifdef USE_EPOLL
+	  if (lr [i].active)
+	    continue;
+#endif
+	  l = getrec (h [i], bufs [i], len);
+	  if (fn (i, bufs [i], l, arg))
+	    {
+	      done [i] = 1;
+	      active--;
+	    }
+	}
+    }
+
+#ifdef USE_EPOLL
+  close (epfd);
+  free (events);
+  free (lr);
+#endif
+  for (i = 0; i < count; i++)
+    free (bufs [i]);
+  free (bufs);
+  free (done);
+}
@@ -22,6 +22,13 @@
 
 typedef struct mtape_t *tape_handle_t;  /* opaque type */
 
+/* largest record the tape routines handle */
+#define TAPE_MAX_REC_LEN 1048576
+
+/* called by tapeloop() with each record read from tape number "index"
+   (len 0 = tape mark), return NZ to stop reading that tape */
+typedef int (*tape_record_fn) (int index, void *buf, int len, void *arg);
+
 
 /* tape flags */
 #define TF_DEFAULT	0x000
@@ -29,6 +36,9 @@ typedef struct mtape_t *tape_handle_t;  /* opaque type */
 
 
 /* open a tape drive */
+/* "sim:file" opens an image file behind a simulated drive, whose timing is
+   set by TAPESIM="bpi=N,ips=N,gap=inches,start=ms,reposition=ms,buffer=bytes";
+   with a buffer, an underrun is only counted once the buffer drains */
 tape_handle_t opentape (char *name, int create, int writable);
 
 /* close a tape drive */
@@ -43,6 +53,23 @@ void posneot (tape_handle_t h);
 /* read a tape record, return actual length (0=tape mark) */
 int getrec (tape_handle_t h, void *buf, int len);
 
+/* read just the length of a tape record (0=tape mark), seeking past its
+   data in image files; "dataoff" (if not NULL) gets the file offset of the
+   data, or -1 if it isn't available */
+int getreclen (tape_handle_t h, off_t *dataoff);
+
+/* getreclen() for a seekable image file that returns -1 instead of
+   exiting when the image is truncated or corrupt, or isn't an image */
+int tapeimagereclen (tape_handle_t h);
+
+/* file descriptor of a regular tape image file, -1 otherwise */
+int tapeimagefd (tape_handle_t h);
+
+/* copy "len" bytes of an image file starting at "off" to the current
+   position of "outfd", by copy_file_range() where possible; returns the
+   count copied, short at end of file, or -1 on error */
+off_t tapeimagecopy (int infd, off_t off, int outfd, off_t len);
+
 /* write a tape record */
 void putrec (tape_handle_t h, void *buf, int len);
 
@@ -57,3 +84,22 @@ void skipfile (tape_handle_t h, int count);
 
 /* set tape flags */
 void tapeflags (tape_handle_t h, int flags);
+
+/* set the status the tape routines exit with on errors (default 1) */
+void tapefailstatus (int status);
+
+/* set up a local or remote drive from a profile ("1600", "800", "6250",
+   "native", "lto", "lto-compress"), optionally followed by overrides
+   ",density=N,block=N,buffer=0|1,compress=0|1,bpi=N"; opentape() uses the
+   TAPEPROFILE environment variable, or "1600"; returns -1 if bad */
+int tapeprofile (tape_handle_t h, char *spec);
+
+/* read up to "bytes" ahead from a local or simulated drive in a separate
+   thread (0=off); the TAPEBUFFER environment variable sets this in
+   megabytes for every tape opened for reading */
+void tapereadahead (tape_handle_t h, size_t bytes);
+
+/* read "count" tapes concurrently from one thread, passing every record to
+   fn(); remote (rmt) tapes are serviced as their responses arrive */
+void tapeloop (tape_handle_t *h, int count, int len, tape_record_fn fn,
+	       void *arg);
@@ -22,21 +22,43 @@
 #include "stdio.h"
 #include "stdarg.h"
 #include "stdlib.h"
+#include "errno.h"
+#include "string.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "pthread.h"
+#include "time.h"
+#include "limits.h"
+#include "sys/stat.h"
 
 #include "tapeio.h"
 
-#define MAX_REC_LEN 32768
+#define MAX_REC_LEN TAPE_MAX_REC_LEN
+
+/* default size of the buffer for each output file */
+#define OUTPUT_BUFFER (1024 * 1024)
+
+/* with writer threads, data is handed over in chunks of this size, and
+   at most this much is held waiting to be written */
+#define OUTPUT_CHUNK (256 * 1024)
+#define MAX_BUFFERED (64 * 1024 * 1024)
+
+#define TAR_BLOCK 512
 
 
 typedef unsigned int u32;      /* non-portable!!! */
+typedef unsigned long long u64;
 
 
 char *progname;
 int print_verbose = 0;
+FILE *tar = NULL;		/* -t archive */
 
 void print_usage (FILE *f)
 {
-  fprintf (f, "Usage: %s in\n", progname);
+  fprintf (f, "Usage: %s [-s] [-v] [-b bufsize] [-j workers | -t archive|-]\n",
+	   progname);
+  fprintf (f, "          [-o template] [-S files-per-dir] [-M manifest] in\n");
 }
 
 void fatal (int retval, char *fmt, ...)
@@ -63,24 +85,453 @@ void verbose (char *fmt, ...)
   va_list ap;
   va_start (ap, fmt);
   if (print_verbose)
-    vfprintf (stdout, fmt, ap);
+    vfprintf (tar == stdout ? stderr : stdout, fmt, ap);
   va_end (ap);
 }
 
 
+/* output files are written through a large buffer, and flushed only
+   when they're closed at the tape mark */
+char *outbuf;
+int outbufsize = OUTPUT_BUFFER;
+FILE *dst = NULL;
+char dstname [PATH_MAX];
+
+
+/* with -j, the reader hands each tape file's data to a pool of writer
+   threads in chunks; the files never overlap, so each one is written by
+   a single worker independently of the others */
+struct chunk
+{
+  struct chunk *next;
+  int len;
+  char data [OUTPUT_CHUNK];
+};
+
+struct outfile
+{
+  struct outfile *next;		/* waiting for a worker */
+  char name [PATH_MAX];
+  struct chunk *head, *tail;	/* data not yet written */
+  int done;			/* tape mark seen, no more chunks */
+};
+
+int workers = 0;
+pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t out_cond = PTHREAD_COND_INITIALIZER;
+struct outfile *waiting_head = NULL, *waiting_tail = NULL;
+struct outfile *current = NULL;	/* being read */
+struct chunk *fill = NULL;	/* being filled for it */
+long buffered = 0;		/* bytes in chunks not yet written */
+long max_buffered = MAX_BUFFERED;
+int finished = 0;
+
+
+void *worker (void *arg)
+{
+  struct outfile *o;
+  struct chunk *c;
+  int fd;
+
+  pthread_mutex_lock (& out_lock);
+  for (;;)
+    {
+      while (! waiting_head && ! finished)
+	pthread_cond_wait (& out_cond, & out_lock);
+      if (! waiting_head)
+	break;
+      o = waiting_head;
+      waiting_head = o->next;
+      pthread_mutex_unlock (& out_lock);
+
+      fd = open (o->name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (fd < 0)
+	fatal (4, "can't create %s\n", o->name);
+
+      pthread_mutex_lock (& out_lock);
+      for (;;)
+	{
+	  while (! o->head && ! o->done)
+	    pthread_cond_wait (& out_cond, & out_lock);
+	  if (! (c = o->head))
+	    break;
+	  o->head = c->next;
+	  pthread_mutex_unlock (& out_lock);
+	  if (write (fd, c->data, c->len) != c->len)
+	    fatal (4, "error writing %s\n", o->name);
+	  pthread_mutex_lock (& out_lock);
+	  buffered -= sizeof (struct chunk);
+	  free (c);
+	  pthread_cond_broadcast (& out_cond);
+	}
+      pthread_mutex_unlock (& out_lock);
+
+      if (close (fd) < 0)
+	fatal (4, "error writing %s\n", o->name);
+      free (o);
+      pthread_mutex_lock (& out_lock);
+    }
+  pthread_mutex_unlock (& out_lock);
+  return (NULL);
+}
+
+
+/* pass the chunk being filled on to the current file's worker; called
+   with out_lock held */
+void publish_chunk (void)
+{
+  if (! fill)
+    return;
+  fill->next = NULL;
+  if (current->head)
+    current->tail->next = fill;
+  else
+    current->head = fill;
+  current->tail = fill;
+  fill = NULL;
+  pthread_cond_broadcast (& out_cond);
+}
+
+
+/* with -t, the tape files become the members of a single ustar archive
+   instead of separate files; a member's size is only known at the tape
+   mark, so its header is filled in afterwards if the archive can seek,
+   and otherwise the data is spooled to a temporary file first */
+int tar_seekable;
+off_t tar_header;		/* where the current member's header is */
+u64 tar_size;	/* and the size of its data */
+
+
+void tar_number (char *field, int width, u64 n)
+{
+  int i;
+
+  if (n < (1ULL << (3 * (width - 1))))
+    {
+      sprintf (field, "%0*llo", width - 1, n);
+      return;
+    }
+  /* too big for octal, GNU tar's base-256 encoding */
+  for (i = width - 1; i > 0; i--, n >>= 8)
+    field [i] = n & 0xff;
+  field [0] = 0x80;
+}
+
+
+void tar_make_header (unsigned char *h, char *name, u64 size)
+{
+  unsigned int sum = 0;
+  char *p;
+  int i;
+
+  memset (h, 0, TAR_BLOCK);
+  /* a long name is split at a slash into the ustar prefix field */
+  p = strlen (name) > 100 ? strchr (name + strlen (name) - 101, '/') : NULL;
+  if (p && p - name <= 155)
+    {
+      memcpy (h + 345, name, p - name);
+      name = p + 1;
+    }
+  strncpy ((char *) h, name, 100);
+  tar_number ((char *) h + 100, 8, 0644);		/* mode */
+  tar_number ((char *) h + 108, 8, 0);			/* uid */
+  tar_number ((char *) h + 116, 8, 0);			/* gid */
+  tar_number ((char *) h + 124, 12, size);
+  tar_number ((char *) h + 136, 12, time (NULL));	/* mtime */
+  h [156] = '0';					/* regular file */
+  memcpy (h + 257, "ustar", 6);
+  memcpy (h + 263, "00", 2);
+
+  memset (h + 148, ' ', 8);
+  for (i = 0; i < TAR_BLOCK; i++)
+    sum += h [i];
+  sprintf ((char *) h + 148, "%06o", sum);
+}
+
+
+void tar_write (FILE *f, void *p, size_t len)
+{
+  if (fwrite (p, 1, len, f) != len)
+    fatal (4, "error writing archive\n");
+}
+
+
+void tar_start_member (void)
+{
+  static unsigned char zero [TAR_BLOCK];
+
+  tar_size = 0;
+  if (tar_seekable)
+    {
+      tar_header = ftello (tar);
+      tar_write (tar, zero, TAR_BLOCK);
+      dst = tar;
+    }
+  else if (! (dst = tmpfile ()))
+    fatal (4, "can't create spool file\n");
+}
+
+
+void tar_end_member (void)
+{
+  unsigned char h [TAR_BLOCK];
+  static unsigned char zero [TAR_BLOCK];
+  size_t n;
+
+  tar_make_header (h, dstname, tar_size);
+  if (tar_seekable)
+    {
+      if (fseeko (tar, tar_header, SEEK_SET) < 0)
+	fatal (4, "can't seek archive\n");
+      tar_write (tar, h, TAR_BLOCK);
+      if (fseeko (tar, 0, SEEK_END) < 0)
+	fatal (4, "can't seek archive\n");
+    }
+  else
+    {
+      tar_write (tar, h, TAR_BLOCK);
+      rewind (dst);
+      while ((n = fread (outbuf, 1, outbufsize, dst)) > 0)
+	tar_write (tar, outbuf, n);
+      if (ferror (dst))
+	fatal (4, "error reading spool file\n");
+      fclose (dst);
+    }
+  tar_write (tar, zero, (TAR_BLOCK - tar_size % TAR_BLOCK) % TAR_BLOCK);
+}
+
+
+void open_tar (char *fn)
+{
+  if (strcmp (fn, "-") == 0)
+    tar = stdout;
+  else if (! (tar = fopen (fn, "wb")))
+    fatal (4, "can't create %s\n", fn);
+  tar_seekable = fseeko (tar, 0, SEEK_CUR) == 0 && ftello (tar) >= 0;
+  setvbuf (tar, NULL, _IOFBF, OUTPUT_BUFFER);
+}
+
+
+void close_tar (void)
+{
+  static unsigned char zero [2 * TAR_BLOCK];
+
+  tar_write (tar, zero, sizeof (zero));
+  if (fclose (tar) != 0)
+    fatal (4, "error writing archive\n");
+}
+
+
+/* a record of an image file is copied straight from the image to the
+   output file by the kernel; only the length words are read here */
+int imagefd = -1;
+int dstfd;
+
+
+void copy_output (off_t off, int len)
+{
+  off_t n;
+
+  n = tapeimagecopy (imagefd, off, dstfd, len);
+  if (n < 0)
+    fatal (4, "error writing %s: %s\n", dstname, strerror (errno));
+  if (n < len)
+    fatal (4, "unexpected end of image\n");
+}
+
+
+/* output file names come from a printf-style template with a single
+   conversion for the file number; with -S, every "shard" consecutive
+   files go in a numbered subdirectory of the template's directory, so
+   no directory gets too big */
+char *template = "file%04d";
+int shard = 0;
+FILE *manifest = NULL;
+
+
+/* check that the template has exactly one integer conversion */
+void check_template (char *t)
+{
+  int conversions = 0;
+
+  for (; *t; t++)
+    {
+      if (*t != '%')
+	continue;
+      if (*++t == '%')
+	continue;
+      t += strspn (t, "-0 +#");
+      t += strspn (t, "0123456789");
+      if (! *t || ! strchr ("diuoxX", *t))
+	fatal (1, "bad conversion in output template\n");
+      conversions++;
+    }
+  if (conversions != 1)
+    fatal (1, "output template needs one conversion for the file number\n");
+}
+
+
+void make_name (u32 file)
+{
+  char name [PATH_MAX];
+  char *base;
+  int dirlen;
+
+  if (snprintf (name, sizeof (name), template, file) >= sizeof (name))
+    fatal (4, "output file name too long\n");
+  if (! shard)
+    {
+      strcpy (dstname, name);
+      return;
+    }
+
+  base = strrchr (name, '/');
+  dirlen = base ? base + 1 - name : 0;
+  if (snprintf (dstname, sizeof (dstname), "%.*s%04d/%s", dirlen, name,
+		file / shard, name + dirlen) >= sizeof (dstname))
+    fatal (4, "output file name too long\n");
+
+  /* the first file of a shard creates its directory */
+  if (! tar && file % shard == 0)
+    {
+      base = strrchr (dstname, '/');
+      *base = '\0';
+      if (mkdir (dstname, 0777) < 0 && errno != EEXIST)
+	fatal (4, "can't create directory %s: %s\n", dstname,
+	       strerror (errno));
+      *base = '/';
+    }
+}
+
+
+void open_output (u32 file)
+{
+  make_name (file);
+  if (workers)
+    {
+      current = calloc (1, sizeof (struct outfile));
+      if (! current)
+	fatal (2, "can't allocate buffer\n");
+      strcpy (current->name, dstname);
+      pthread_mutex_lock (& out_lock);
+      if (waiting_head)
+	waiting_tail->next = current;
+      else
+	waiting_head = current;
+      waiting_tail = current;
+      pthread_cond_broadcast (& out_cond);
+      pthread_mutex_unlock (& out_lock);
+      return;
+    }
+
+  if (tar)
+    {
+      tar_start_member ();
+      return;
+    }
+
+  if (imagefd >= 0)
+    {
+      dstfd = open (dstname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (dstfd < 0)
+	fatal (4, "can't create %s\n", dstname);
+      return;
+    }
+
+  dst = fopen (dstname, "wb");
+  if (! dst)
+    fatal (4, "can't create %s\n", dstname);
+  setvbuf (dst, outbuf, _IOFBF, outbufsize);
+}
+
+
+void write_output (char *buf, int len)
+{
+  int n;
+
+  if (! workers)
+    {
+      if (fwrite (buf, 1, len, dst) != len)
+	fatal (4, "error writing %s\n", dstname);
+      tar_size += len;
+      return;
+    }
+
+  while (len > 0)
+    {
+      if (! fill)
+	{
+	  /* wait for the workers to catch up if too much is buffered */
+	  pthread_mutex_lock (& out_lock);
+	  while (buffered + sizeof (struct chunk) > max_buffered && buffered)
+	    pthread_cond_wait (& out_cond, & out_lock);
+	  buffered += sizeof (struct chunk);
+	  pthread_mutex_unlock (& out_lock);
+	  fill = malloc (sizeof (struct chunk));
+	  if (! fill)
+	    fatal (2, "can't allocate buffer\n");
+	  fill->len = 0;
+	}
+      n = OUTPUT_CHUNK - fill->len;
+      if (n > len)
+	n = len;
+      memcpy (fill->data + fill->len, buf, n);
+      fill->len += n;
+      buf += n;
+      len -= n;
+      if (fill->len == OUTPUT_CHUNK)
+	{
+	  pthread_mutex_lock (& out_lock);
+	  publish_chunk ();
+	  pthread_mutex_unlock (& out_lock);
+	}
+    }
+}
+
+
+void close_output (void)
+{
+  if (tar)
+    {
+      tar_end_member ();
+      return;
+    }
+  if (imagefd >= 0)
+    {
+      if (close (dstfd) < 0)
+	fatal (4, "error writing %s\n", dstname);
+      return;
+    }
+  if (! workers)
+    {
+      if (fclose (dst) != 0)
+	fatal (4, "error writing %s\n", dstname);
+      return;
+    }
+
+  pthread_mutex_lock (& out_lock);
+  publish_chunk ();
+  current->done = 1;
+  pthread_cond_broadcast (& out_cond);
+  pthread_mutex_unlock (& out_lock);
+}
+
+
 int main (int argc, char *argv[])
 {
   u32 file = 0;
-  u32 record = 0;
-  u32 filebytes = 0;
-  u32 tapebytes = 0;
+  u64 record = 0;
+  u64 filebytes = 0;
+  u64 tapebytes = 0;
   u32 len;
+  off_t dataoff;
   char *srcfn = NULL;
   tape_handle_t src = NULL;
-  FILE *dst = NULL;
   char *buf;
   int tape_flags = TF_DEFAULT;
-  char filename[100];
+  pthread_t *worker_thread = NULL;
+  char *tarfn = NULL;
+  int i;
 
   progname = argv [0];
 
@@ -92,6 +543,50 @@ int main (int argc, char *argv[])
 	    tape_flags |= TF_SIMH;
 	  else if (argv [0][1] == 'v')
 	    print_verbose = 1;
+	  else if (argv [0][1] == 'b')
+	    {
+	      if (! --argc)
+		fatal (1, "missing buffer size\n");
+	      outbufsize = atoi ((++argv) [0]);
+	      if (outbufsize <= 0)
+		fatal (1, "bad buffer size '%s'\n", argv [0]);
+	    }
+	  else if (argv [0][1] == 'j')
+	    {
+	      if (! --argc)
+		fatal (1, "missing worker count\n");
+	      workers = atoi ((++argv) [0]);
+	      if (workers <= 0)
+		fatal (1, "bad worker count '%s'\n", argv [0]);
+	    }
+	  else if (argv [0][1] == 'o')
+	    {
+	      if (! --argc)
+		fatal (1, "missing output template\n");
+	      template = (++argv) [0];
+	      check_template (template);
+	    }
+	  else if (argv [0][1] == 'S')
+	    {
+	      if (! --argc)
+		fatal (1, "missing shard size\n");
+	      shard = atoi ((++argv) [0]);
+	      if (shard <= 0)
+		fatal (1, "bad shard size '%s'\n", argv [0]);
+	    }
+	  else if (argv [0][1] == 'M')
+	    {
+	      if (! --argc)
+		fatal (1, "missing manifest name\n");
+	      if (! (manifest = fopen ((++argv) [0], "w")))
+		fatal (4, "can't create %s\n", argv [0]);
+	    }
+	  else if (argv [0][1] == 't')
+	    {
+	      if (! --argc)
+		fatal (1, "missing archive name\n");
+	      tarfn = (++argv) [0];
+	    }
 	  else
 	    fatal (1, "unrecognized option '%s'\n", argv [0]);
 	}
@@ -103,9 +598,12 @@ int main (int argc, char *argv[])
 
   if (! srcfn)
     fatal (1, NULL);
+  if (tarfn && workers)
+    fatal (1, "an archive is written by a single thread\n");
 
   buf = malloc (MAX_REC_LEN);
-  if (! buf)
+  outbuf = malloc (outbufsize);
+  if (! buf || ! outbuf)
     fatal (2, "can't allocate buffer\n");
 
   src = opentape (srcfn, 0, 0);
@@ -114,39 +612,64 @@ int main (int argc, char *argv[])
 
   tapeflags (src, tape_flags);
 
-  dst = fopen("file0000", "wb");
+  if (tarfn)
+    open_tar (tarfn);
+  else if (! workers)
+    imagefd = tapeimagefd (src);
+
+  if (workers)
+    {
+      worker_thread = calloc (workers, sizeof (pthread_t));
+      if (! worker_thread)
+	fatal (2, "can't allocate buffer\n");
+      for (i = 0; i < workers; i++)
+	if (pthread_create (& worker_thread [i], NULL, worker, NULL) != 0)
+	  fatal (2, "can't start writer thread\n");
+    }
 
+  /* an output file is only started by the first record of a tape file,
+     so the end of tape doesn't leave an empty one behind */
   for (;;)
     {
-      len = getrec (src, buf, MAX_REC_LEN);
+      if (imagefd >= 0)
+	len = getreclen (src, & dataoff);
+      else
+	len = getrec (src, buf, MAX_REC_LEN);
       if (len == 0)
 	{
-	  fclose (dst);
-
 	  if (filebytes == 0)
 	    {
 	      verbose ("end of tape\n");
 	      break;
 	    }
 
-	  verbose ("total length of file %d = %d records, %u bytes\n",
+	  close_output ();
+	  if (manifest)
+	    fprintf (manifest, "%u %s %llu %llu\n", file, dstname, record,
+		     filebytes);
+
+	  verbose ("total length of file %d = %llu records, %llu bytes\n",
 		   file, record, filebytes);
 	  tapebytes += filebytes;
 	  file++;
 	  record = 0;
 	  filebytes = 0;
 	  verbose ("start of file %d\n", file);
-	  sprintf (filename, "file%04d", file);
-	  dst = fopen(filename, "wb");
-	  
-	  fflush (stdout);
+
+	  if (print_verbose)
+	    fflush (stdout);
 	}
       else
 	{
-	  verbose ("file %d record %d: length %d\n", file, record, len);
-	  fflush (stdout);
-	  fwrite (buf, 1, len, dst);
-	  fflush (dst);
+	  verbose ("file %d record %llu: length %d\n", file, record, len);
+	  if (print_verbose)
+	    fflush (stdout);
+	  if (record == 0)
+	    open_output (file);
+	  if (imagefd >= 0)
+	    copy_output (dataoff, len);
+	  else
+	    write_output (buf, len);
 	  filebytes += len;
 	  record++;
 	}
@@ -154,5 +677,20 @@ int main (int argc, char *argv[])
 
   closetape (src);
 
+  if (tar)
+    close_tar ();
+  if (manifest && fclose (manifest) != 0)
+    fatal (4, "error writing manifest\n");
+
+  if (workers)
+    {
+      pthread_mutex_lock (& out_lock);
+      finished = 1;
+      pthread_cond_broadcast (& out_cond);
+      pthread_mutex_unlock (& out_lock);
+      for (i = 0; i < workers; i++)
+	pthread_join (worker_thread [i], NULL);
+    }
+
   return (0);
 }
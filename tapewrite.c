@@ -19,16 +19,34 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE	/* for F_SETPIPE_SZ */
+
 #include "stdio.h"
 #include "stdarg.h"
 #include "stdlib.h"
+#include "errno.h"
+#include "pthread.h"
+#include "string.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
 
 #include "tapeio.h"
 
-#define MAX_REC_LEN 32768
+#define MAX_REC_LEN TAPE_MAX_REC_LEN
+
+/* bytes of records each -j builder frames and writes at a time */
+#define BUILD_BATCH (1024 * 1024)
+
+/* size of each of the two buffers a stream input is read into, and of
+   the pipe it comes through */
+#define STREAM_BUFFER (4 * 1024 * 1024)
+#define PIPE_BUFFER (1024 * 1024)
 
 
 typedef unsigned int u32;      /* non-portable!!! */
+typedef unsigned long long u64;
 
 
 char *progname;
@@ -36,7 +54,9 @@ int print_verbose = 0;
 
 void print_usage (FILE *f)
 {
-  fprintf (f, "Usage: %s out files...\n", progname);
+  fprintf (f, "Usage: %s [-s] [-v] [-m] [-j threads] [-i index] "
+	   "[-n recordlen] [-S]\n", progname);
+  fprintf (f, "          [-l lengths] [-F] out file|-|!command...\n");
 }
 
 void fatal (int retval, char *fmt, ...)
@@ -68,18 +88,505 @@ void verbose (char *fmt, ...)
 }
 
 
+/* -S: the last record of a file is only as long as the data left for
+   it, instead of being padded out to the record length */
+int short_records = 0;
+
+
+/* -l: record lengths to cut the input files into, in the same form as
+   the -i index, a tape mark ending each input file */
+FILE *lengths = NULL;
+
+u32 next_length (void)
+{
+  unsigned int len;
+
+  if (fscanf (lengths, "%u", & len) != 1)
+    fatal (3, "record length list ended early\n");
+  if (len > MAX_REC_LEN)
+    fatal (3, "record length %u too long\n", len);
+  return (len);
+}
+
+
+/* -i: the length of every record written, one per line, 0 for a tape
+   mark, in the order they are on the tape */
+FILE *index_file = NULL;
+
+void index_records (u64 count, u32 len)
+{
+  if (! index_file)
+    return;
+  while (count--)
+    fprintf (index_file, "%u\n", len);
+}
+
+
+/* -j: with an image file as the output, the size of every input file
+   gives the offset of all its records, so the files are framed and
+   written into their places by several threads at once */
+struct input
+{
+  char *fn;
+  off_t size;
+  off_t offset;			/* of its first record in the image */
+  u64 records;
+};
+
+struct input *inputs;
+int ninputs;
+int next_input = 0;
+pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER;
+int image_fd;
+u32 layout_recordlen;
+
+
+void *builder (void *arg)
+{
+  u32 recordlen = layout_recordlen;
+  u32 batch = BUILD_BATCH / (recordlen + 8) + 1;
+  char *in = malloc ((size_t) batch * recordlen);
+  unsigned char *out = malloc ((size_t) batch * (recordlen + 8));
+  unsigned char *p;
+  struct input *f;
+  off_t pos, inpos;
+  u64 r;
+  u32 n, i, len;
+  ssize_t got;
+  int fd;
+
+  if (! in || ! out)
+    fatal (2, "can't allocate buffer\n");
+  for (;;)
+    {
+      pthread_mutex_lock (& input_lock);
+      f = (next_input < ninputs) ? & inputs [next_input++] : NULL;
+      pthread_mutex_unlock (& input_lock);
+      if (! f)
+	break;
+
+      fd = open (f->fn, O_RDONLY);
+      if (fd < 0)
+	fatal (3, "can't open %s\n", f->fn);
+      pos = f->offset;
+      inpos = 0;
+      for (r = 0; r < f->records; r += n)
+	{
+	  n = (f->records - r < batch) ? f->records - r : batch;
+	  memset (in, 0, (size_t) n * recordlen);	/* pad the last one */
+	  for (i = 0; inpos < f->size && i < n * recordlen; i += got)
+	    {
+	      got = pread (fd, in + i, n * recordlen - i, inpos);
+	      if (got <= 0)
+		fatal (3, "%s changed size\n", f->fn);
+	      inpos += got;
+	    }
+	  for (i = 0, p = out; i < n; i++, p += len + 8)
+	    {
+	      len = recordlen;
+	      if (short_records && r + i == f->records - 1 &&
+		  f->size % recordlen)
+		len = f->size % recordlen;
+	      p [0] = p [len + 4] = len & 0377;
+	      p [1] = p [len + 5] = (len >> 8) & 0377;
+	      p [2] = p [len + 6] = (len >> 16) & 0377;
+	      p [3] = p [len + 7] = (len >> 24) & 0377;
+	      memcpy (p + 4, in + (size_t) i * recordlen, len);
+	    }
+	  for (i = 0; i < p - out; i += got)
+	    {
+	      got = pwrite (image_fd, out + i, (p - out) - i, pos + i);
+	      if (got <= 0)
+		fatal (4, "error writing image: %s\n", strerror (errno));
+	    }
+	  pos += p - out;
+	}
+      /* its tape mark */
+      memset (out, 0, 4);
+      if (pwrite (image_fd, out, 4, pos) != 4)
+	fatal (4, "error writing image: %s\n", strerror (errno));
+      close (fd);
+    }
+  free (in);
+  free (out);
+  return (NULL);
+}
+
+
+/* lay out the image, then let "threads" builders fill it in */
+u64 build_parallel (tape_handle_t dst, char **fns, int count, u32 recordlen,
+		    int threads)
+{
+  struct stat st;
+  pthread_t *thread;
+  off_t offset;
+  off_t bytes;
+  u64 tapebytes = 0;
+  int i;
+
+  image_fd = tapeimagefd (dst);
+  if (image_fd < 0)
+    fatal (1, "-j needs an image file as the output\n");
+  inputs = calloc (count, sizeof (struct input));
+  thread = calloc (threads, sizeof (pthread_t));
+  if (! inputs || ! thread)
+    fatal (2, "can't allocate file table\n");
+
+  offset = lseek (image_fd, 0, SEEK_CUR);
+  for (i = 0; i < count; i++)
+    {
+      if (stat (fns [i], & st) < 0)
+	fatal (3, "can't open %s\n", fns [i]);
+      inputs [i].fn = fns [i];
+      inputs [i].size = st.st_size;
+      inputs [i].offset = offset;
+      inputs [i].records = (st.st_size + recordlen - 1) / recordlen;
+      bytes = (off_t) inputs [i].records * recordlen;
+      if (short_records && st.st_size % recordlen)
+	{
+	  bytes = st.st_size;
+	  index_records (inputs [i].records - 1, recordlen);
+	  index_records (1, st.st_size % recordlen);
+	}
+      else
+	index_records (inputs [i].records, recordlen);
+      index_records (1, 0);
+      offset += bytes + (off_t) inputs [i].records * 8 + 4;
+      tapebytes += bytes;
+      verbose ("file %s: %llu records at offset %lld\n", fns [i],
+	       inputs [i].records, (long long) inputs [i].offset);
+    }
+  ninputs = count;
+  layout_recordlen = recordlen;
+
+  for (i = 0; i < threads; i++)
+    if (pthread_create (& thread [i], NULL, builder, NULL) != 0)
+      fatal (2, "can't start builder thread\n");
+  for (i = 0; i < threads; i++)
+    pthread_join (thread [i], NULL);
+
+  /* closetape() adds the final tape mark after everything */
+  if (lseek (image_fd, offset, SEEK_SET) != offset)
+    fatal (4, "can't seek image\n");
+  free (thread);
+  return (tapebytes);
+}
+
+
+/* -m: map an input file and hand record sized slices of the mapping
+   straight to putrec(), which writes an image record with a single
+   writev(), so the data is never copied here; a short last record is
+   padded with zeros unless -S; returns the number of bytes written */
+u64 write_mapped (tape_handle_t dst, char *fn, char *buf, u32 recordlen,
+		  u64 *records)
+{
+  int fd;
+  struct stat st;
+  char *map = NULL;
+  off_t off;
+  u32 len;
+  u64 bytes = 0;
+
+  *records = 0;
+  fd = open (fn, O_RDONLY);
+  if (fd < 0 || fstat (fd, & st) < 0)
+    fatal (3, "can't open %s\n", fn);
+  if (st.st_size > 0)
+    {
+      map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED)
+	fatal (3, "can't map %s\n", fn);
+      madvise (map, st.st_size, MADV_SEQUENTIAL);
+    }
+
+  for (off = 0; ; off += len)
+    {
+      len = (st.st_size - off < recordlen) ? st.st_size - off : recordlen;
+      verbose ("read %u bytes\n", len);
+      if (len == 0)
+	break;
+      if (len == recordlen || short_records)
+	{
+	  putrec (dst, map + off, len);
+	  index_records (1, len);
+	  bytes += len;
+	}
+      else
+	{
+	  memcpy (buf, map + off, len);
+	  memset (buf + len, 0, recordlen - len);
+	  putrec (dst, buf, recordlen);
+	  index_records (1, recordlen);
+	  bytes += recordlen;
+	}
+      (*records)++;
+      if (len < recordlen)
+	break;
+    }
+
+  if (map)
+    munmap (map, st.st_size);
+  close (fd);
+  return (bytes);
+}
+
+
+/* inputs named "-" (standard input) or "!command" (the output of a
+   command) are streams; a thread reads each one into two large buffers
+   in turn, so the producer keeps running while records are written
+   from the other buffer.  With -F, a stream carries several tape files,
+   each one preceded by a line giving its length in bytes. */
+struct stream
+{
+  int fd;
+  FILE *pipe;			/* from popen(), or NULL */
+  char *buf [2];
+  size_t len [2];
+  int filled [2];		/* ready for the consumer */
+  int eof [2];			/* nothing more after this buffer */
+  int cur;			/* buffer being consumed */
+  int ready;			/* and it has been waited for */
+  size_t pos;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+FILE *src = NULL;		/* a regular input file, or */
+struct stream *stream = NULL;	/* a stream */
+int framed = 0;			/* -F */
+u64 segment_left;		/* bytes left of the current framed file */
+
+
+void *stream_reader (void *arg)
+{
+  struct stream *s = arg;
+  int i = 0;
+  size_t n;
+  ssize_t r;
+  int eof = 0;
+
+  while (! eof)
+    {
+      pthread_mutex_lock (& s->lock);
+      while (s->filled [i])
+	pthread_cond_wait (& s->cond, & s->lock);
+      pthread_mutex_unlock (& s->lock);
+
+      for (n = 0; n < STREAM_BUFFER; n += r)
+	{
+	  r = read (s->fd, s->buf [i] + n, STREAM_BUFFER - n);
+	  if (r < 0 && errno == EINTR)
+	    r = 0;
+	  else if (r < 0)
+	    fatal (3, "error reading input: %s\n", strerror (errno));
+	  else if (r == 0)
+	    {
+	      eof = 1;
+	      break;
+	    }
+	}
+
+      pthread_mutex_lock (& s->lock);
+      s->len [i] = n;
+      s->eof [i] = eof;
+      s->filled [i] = 1;
+      pthread_cond_broadcast (& s->cond);
+      pthread_mutex_unlock (& s->lock);
+      i ^= 1;
+    }
+  return (NULL);
+}
+
+
+/* like fread(), short only at the end of the stream */
+size_t stream_read (struct stream *s, char *dst, size_t n)
+{
+  size_t got = 0;
+  size_t k;
+
+  while (got < n)
+    {
+      if (! s->ready)
+	{
+	  pthread_mutex_lock (& s->lock);
+	  while (! s->filled [s->cur])
+	    pthread_cond_wait (& s->cond, & s->lock);
+	  pthread_mutex_unlock (& s->lock);
+	  s->ready = 1;
+	  s->pos = 0;
+	}
+      k = s->len [s->cur] - s->pos;
+      if (k > n - got)
+	k = n - got;
+      memcpy (dst + got, s->buf [s->cur] + s->pos, k);
+      s->pos += k;
+      got += k;
+      if (s->pos == s->len [s->cur])
+	{
+	  if (s->eof [s->cur])
+	    break;
+	  /* hand the buffer back to the reader */
+	  pthread_mutex_lock (& s->lock);
+	  s->filled [s->cur] = 0;
+	  pthread_cond_broadcast (& s->cond);
+	  pthread_mutex_unlock (& s->lock);
+	  s->cur ^= 1;
+	  s->ready = 0;
+	}
+    }
+  return (got);
+}
+
+
+int is_stream (char *name)
+{
+  return (strcmp (name, "-") == 0 || name [0] == '!');
+}
+
+
+void open_stream (char *name)
+{
+  struct stat st;
+
+  stream = calloc (1, sizeof (struct stream));
+  if (! stream)
+    fatal (2, "can't allocate buffer\n");
+  if (name [0] == '!')
+    {
+      stream->pipe = popen (name + 1, "r");
+      if (! stream->pipe)
+	fatal (3, "can't run %s\n", name + 1);
+      stream->fd = fileno (stream->pipe);
+    }
+  else
+    stream->fd = 0;
+
+#ifdef F_SETPIPE_SZ
+  /* let the producer get further ahead of us */
+  if (fstat (stream->fd, & st) == 0 && S_ISFIFO (st.st_mode))
+    fcntl (stream->fd, F_SETPIPE_SZ, PIPE_BUFFER);
+#endif
+
+  stream->buf [0] = malloc (STREAM_BUFFER);
+  stream->buf [1] = malloc (STREAM_BUFFER);
+  if (! stream->buf [0] || ! stream->buf [1])
+    fatal (2, "can't allocate buffer\n");
+  pthread_mutex_init (& stream->lock, NULL);
+  pthread_cond_init (& stream->cond, NULL);
+  if (pthread_create (& stream->thread, NULL, stream_reader, stream) != 0)
+    fatal (2, "can't start reader thread\n");
+}
+
+
+void close_stream (char *name)
+{
+  pthread_join (stream->thread, NULL);
+  if (stream->pipe && pclose (stream->pipe) != 0)
+    fatal (3, "%s failed\n", name + 1);
+  free (stream->buf [0]);
+  free (stream->buf [1]);
+  free (stream);
+  stream = NULL;
+}
+
+
+/* read the length line of the next framed tape file; 0 at the end */
+int next_segment (void)
+{
+  char line [32];
+  char *end;
+  int n = 0;
+
+  while (n < sizeof (line) - 1 && stream_read (stream, line + n, 1) == 1)
+    if (line [n++] == '\n')
+      break;
+  if (n == 0)
+    return (0);
+  line [n] = '\0';
+  segment_left = strtoull (line, & end, 10);
+  if (end == line || *end != '\n')
+    fatal (3, "bad tape file length in input stream\n");
+  return (1);
+}
+
+
+/* read up to n bytes of the current tape file */
+size_t read_input (char *buf, size_t n)
+{
+  if (! stream)
+    return (fread (buf, 1, n, src));
+  if (! framed)
+    return (stream_read (stream, buf, n));
+  if (n > segment_left)
+    n = segment_left;
+  if (stream_read (stream, buf, n) != n)
+    fatal (3, "input stream ended in the middle of a tape file\n");
+  segment_left -= n;
+  return (n);
+}
+
+
+/* write the current input file a record at a time; returns the number
+   of bytes written */
+u64 write_records (tape_handle_t dst, char *name, char *buf, u32 recordlen,
+		   u64 *records)
+{
+  u32 want, len;
+  u64 bytes = 0;
+  char c;
+  int last;
+
+  *records = 0;
+  for (;;)
+    {
+      want = lengths ? next_length () : recordlen;
+      len = want ? read_input (buf, want) : 0;
+      verbose ("read %u bytes\n", len);
+      if (lengths && (len != want || (want == 0 && read_input (& c, 1))))
+	fatal (3, "%s doesn't match the record length list\n", name);
+      last = len < want || want == 0;
+      if (len > 0)
+	{
+	  if (len < want && ! short_records)
+	    {
+	      memset (buf + len, 0, want - len);
+	      len = want;
+	    }
+	  putrec (dst, buf, len);
+	  index_records (1, len);
+	  bytes += len;
+	  (*records)++;
+	}
+      if (last)
+	return (bytes);
+    }
+}
+
+
+/* finish a tape file; returns its bytes */
+u64 end_file (tape_handle_t dst, u64 records, u64 bytes)
+{
+  verbose ("end of file, %llu records, %llu bytes\n", records, bytes);
+  tapemark (dst);
+  index_records (1, 0);
+  return (bytes);
+}
+
+
 int main (int argc, char *argv[])
 {
   u32 file = 0;
-  u32 record = 0;
+  u64 record = 0;
   u32 recordlen = 1024;
-  u32 filebytes = 0;
-  u32 tapebytes = 0;
-  u32 len;
+  u64 filebytes = 0;
+  u64 tapebytes = 0;
   tape_handle_t dst = NULL;
-  FILE *src = NULL;
   char *buf;
   int tape_flags = TF_DEFAULT;
+  int use_mmap = 0;
+  int threads = 0;
+  int i;
 
   progname = argv [0];
 
@@ -91,10 +598,40 @@ int main (int argc, char *argv[])
 	    tape_flags |= TF_SIMH;
 	  else if (argv [0][1] == 'v')
 	    print_verbose = 1;
+	  else if (argv [0][1] == 'm')
+	    use_mmap = 1;
+	  else if (argv [0][1] == 'j')
+	    {
+	      if (! --argc)
+		fatal (1, "missing thread count\n");
+	      threads = atoi ((++argv) [0]);
+	      if (threads <= 0)
+		fatal (1, "bad thread count '%s'\n", argv [0]);
+	    }
+	  else if (argv [0][1] == 'F')
+	    framed = 1;
+	  else if (argv [0][1] == 'S')
+	    short_records = 1;
+	  else if (argv [0][1] == 'l')
+	    {
+	      if (! --argc)
+		fatal (1, "missing record length list\n");
+	      if (! (lengths = fopen ((++argv) [0], "r")))
+		fatal (3, "can't open %s\n", argv [0]);
+	    }
+	  else if (argv [0][1] == 'i')
+	    {
+	      if (! --argc)
+		fatal (1, "missing index file name\n");
+	      if (! (index_file = fopen ((++argv) [0], "w")))
+		fatal (3, "can't create %s\n", argv [0]);
+	    }
 	  else if (argv [0][1] == 'n')
 	    {
 	      ++argv, --argc;
 	      recordlen = atoi(argv [0]);
+	      if (recordlen <= 0 || recordlen > MAX_REC_LEN)
+		fatal (1, "record length must be 1 to %d\n", MAX_REC_LEN);
 	    }
 	  else
 	    fatal (1, "unrecognized option '%s'\n", argv [0]);
@@ -108,42 +645,65 @@ int main (int argc, char *argv[])
 	}
     }
 
+  if (lengths && (use_mmap || threads))
+    fatal (1, "a record length list is only read a record at a time\n");
+
   buf = malloc (MAX_REC_LEN);
   if (! buf)
     fatal (2, "can't allocate buffer\n");
 
   tapeflags (dst, tape_flags);
 
+  if (threads && argc > 1)
+    {
+      for (i = 1; i < argc; i++)
+	if (is_stream (argv [i]))
+	  fatal (1, "-j needs its input files laid out in advance\n");
+      file = argc - 1;
+      tapebytes = build_parallel (dst, argv + 1, argc - 1, recordlen,
+				  threads);
+      argc = 1;
+    }
+
   while (++argv, --argc)
     {
-      src = fopen(argv [0], "rb");
-      file++;
-      verbose ("reading from file %s\n", argv [0]);
-      for (;;)
+      if (is_stream (argv [0]))
 	{
-	  len = fread (buf, 1, recordlen, src);
-	  verbose ("read %u bytes\n", len);
-	  if (len > 0)
+	  open_stream (argv [0]);
+	  while (! framed || next_segment ())
 	    {
-	      putrec (dst, buf, recordlen);
-	      tapebytes += recordlen;
-	      filebytes += recordlen;
-	      record++;
-	    }
-	  if (len < recordlen)
-	    {
-	      verbose ("end of file, %u records, %u bytes\n", record, filebytes);
-	      fclose (src);
-	      tapemark (dst);
-	      record = 0;
-	      filebytes = 0;
-	      break;
+	      file++;
+	      verbose ("reading tape file %u from %s\n", file, argv [0]);
+	      filebytes = write_records (dst, argv [0], buf, recordlen,
+					 & record);
+	      tapebytes += end_file (dst, record, filebytes);
+	      if (! framed)
+		break;
 	    }
+	  close_stream (argv [0]);
+	  continue;
+	}
+
+      file++;
+      verbose ("reading from file %s\n", argv [0]);
+      if (use_mmap)
+	filebytes = write_mapped (dst, argv [0], buf, recordlen, & record);
+      else
+	{
+	  src = fopen(argv [0], "rb");
+	  if (! src)
+	    fatal (3, "can't open %s\n", argv [0]);
+	  filebytes = write_records (dst, argv [0], buf, recordlen, & record);
+	  fclose (src);
 	}
+      tapebytes += end_file (dst, record, filebytes);
     }
 
   closetape (dst);
-  verbose ("end of tape, %u files, %u bytes\n", file, tapebytes);
+  index_records (1, 0);		/* the one closetape() adds */
+  if (index_file && fclose (index_file) != 0)
+    fatal (4, "error writing index\n");
+  verbose ("end of tape, %u files, %llu bytes\n", file, tapebytes);
 
   return (0);
 }